@@ -26,6 +26,8 @@ static const char* Properties[] = { //
         P_IP_ADDRESS, //
         P_IP_PORT, //
         P_INITIAL,
+        P_USE_LAST, // restore the relay after a reset or power on
+        P_LAST_STATE, // kept with UseLast
         P_PASSWORD,//
         NULL };
 
@@ -47,6 +49,18 @@ class MppRelay* relay;
 class MppSensor* sensor;
 MppDevice temp; //Temperature sensor
 
+// flash copy for a power on, the RTC copy covers resets.  A state is only
+// written once it has held for LAST_STATE_HOLD, so routine toggles and
+// pulses cost no flash writes; a power loss before that starts with the
+// state saved earlier
+#define LAST_STATE_HOLD 600000 // ms, 10m
+bool lastState = false;
+unsigned long lastStateChanged = 0; // 0 when written
+
+void noteLastState(bool state, unsigned pin) {
+	lastState = state;
+	lastStateChanged = millis() | 1;
+}
 
 
 //The setup function is called once at startup of the sketch
@@ -62,8 +76,14 @@ mppserver.setPropertyDefault(P_RELAY_PIN, "14");
  mppserver.manageDevice(relay, getDefaultUDN(MppMomentary));
  mppserver.manageDevice(&temp, getDefaultUDN(MppAnalog) + "_T");
  mppserver.manageDevice(sensor, getDefaultUDN(MppSensor));
-if (mppserver.hasProperty(P_INITIAL))
+ relay->setRelayHandler(noteLastState);
+// restored from RTC memory after a reset, before any initial state is set
+if (!relay->setUseLast(mppserver.isProperty(P_USE_LAST))) {
+  if (mppserver.isProperty(P_USE_LAST) && mppserver.hasProperty(P_LAST_STATE))
+    relay->setRelay(mppserver.isProperty(P_LAST_STATE), 0);
+  else if (mppserver.hasProperty(P_INITIAL))
     relay->setRelay(mppserver.isProperty(P_INITIAL), 0);
+}
  mppserver.begin();
   sensors.begin();
 
@@ -93,6 +113,12 @@ void loop() {
         String("Check to ") + mppserver.getProperty(P_IP_ADDRESS) + ":"
             + mppserver.getUnsignedProperty(P_IP_PORT)
             + " failed, relay toggled.");
+
+	if (lastStateChanged != 0 && now - lastStateChanged >= LAST_STATE_HOLD) {
+		lastStateChanged = 0;
+		if (mppserver.isProperty(P_USE_LAST)) // only written if it differs
+			mppserver.putProperty(P_LAST_STATE, lastState ? "true" : "false");
+	}
             
 	if (now > next) {
 		Serial.printf("heap=%lus at %lus\n", ESP.getFreeHeap(), now / 1000);
@@ -100,8 +126,10 @@ void loop() {
 		next = now + checkin;
    sensors.requestTemperatures();
    float tempC = sensors.getTempCByIndex(0);
+   temp.beginUpdate();
    temp.put(VALUE, String(tempC));
     temp.put(STATE, tempC == 0 ? "off" : "on");
+   temp.commitUpdate(); // single notification
      Serial.printf("Temperature: %.2f C\n", tempC);
 	}
 }
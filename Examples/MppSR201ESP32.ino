@@ -203,6 +203,7 @@ void setup() {
 //Relay setup
  mppserver.setPropertyDefault(P_Controller_IP, "192.168.1.100");
  mppserver.setPropertyDefault(P_Controller_Port, "6722");
+ mppserver.setPropertyDefault(P_SAVE_DELAY, "2000"); // relay states are saved once commands settle
  relay1 = new class SR201(4,(getDefaultUDN(MppSwitch)+"_1").c_str());
  relay2 = new class SR201(14,(getDefaultUDN(MppSwitch)+"_2").c_str());
  relay3 = new class SR201(15,(getDefaultUDN(MppSwitch)+"_3").c_str());
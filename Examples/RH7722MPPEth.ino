@@ -106,38 +106,38 @@ void loop() {
 
 		next = now + checkin;
 if(CO2!=oldCO2) {
+  MppDeviceUpdate update(co2); // one notification for both
   co2.put(VALUE, String(CO2));
   co2.put(STATE, CO2 == 0 ? "off" : "on");
   oldCO2=CO2;
-  co2.notifySubscribers();
 }
 
 if(Temperature!=oldTemperature) {
+  MppDeviceUpdate update(temp); // one notification for both
   temp.put(VALUE, String(Temperature));
   temp.put(STATE, Temperature == 0 ? "off" : "on");
   oldTemperature=Temperature;
-  temp.notifySubscribers();
 }
 
 if(Humidity!=oldHumidity) {
+  MppDeviceUpdate update(hum); // one notification for both
   hum.put(VALUE, String(Humidity));
   hum.put(STATE, Humidity == 0 ? "off" : "on");
   oldHumidity=Humidity;
-  hum.notifySubscribers();
 }
 
 if(DewPoint!=oldDewPoint) {
+  MppDeviceUpdate update(dw); // one notification for both
   dw.put(VALUE, String(DewPoint));
   dw.put(STATE, DewPoint == 0 ? "off" : "on");
   oldDewPoint=DewPoint;
-  dw.notifySubscribers();
 }
 
 if(WetBulb!=oldWetBulb) {
+  MppDeviceUpdate update(wb); // one notification for both
   wb.put(VALUE, String(WetBulb));
   wb.put(STATE, WetBulb == 0 ? "off" : "on");
   oldWetBulb=WetBulb;
-  wb.notifySubscribers();
 }
 
 	}
@@ -2,9 +2,21 @@
 #include <NetworkUdp.h>
 #include "Mpp32Device.h"
 #include "config.h"
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#endif
 
 // #define UDP_TX_PACKET_MAX_SIZE 2048
 
+//#define DEBUG_MPP_NOTIFY
+#ifdef DEBUG_MPP_NOTIFY
+#define DEBUG_NOTIFY(...) Serial.printf( __VA_ARGS__ )
+#else
+#define DEBUG_NOTIFY(...) do { if (0) Serial.printf( __VA_ARGS__ ); } while (0)
+#endif
+
 
 /*
  * MppDevice.cpp FOR ESP32!!
@@ -24,6 +36,7 @@ const char *P_SENSOR_PIN = "SensorPin"; // unsigned sensor pin
 const char *P_RELAY_PIN = "RelayPin"; // unsigned relay pin
 const char *P_INITIAL = "Initial"; // boolean startup state for relays
 const char *P_USE_LAST = "UseLast"; // persist last state and use on startup
+const char *P_LAST_STATE = "LastState"; // flash copy of the last state, for a power on
 const char *P_IP_CHECK = "IpCheck"; // frequency of "network available" checks in hours
 const char *P_IP_ADDRESS = "IpAddress"; // target of network available connect request
 const char *P_IP_PORT = "IpPort"; // port of network available connect request
@@ -42,7 +55,10 @@ static String UID;
 
 // as indexes to the attribute names
 const char *ATTRIBUTES[] = { "state", "error", "lpress", "value", "firmware", "gated",
-		"temperature", "hue", "saturation", "message", "beacon", "udn", "name", "group","code" };
+		"temperature", "hue", "saturation", "message", "beacon", "udn", "name", "group","code",
+		"mac", "location" };
+static_assert(sizeof(ATTRIBUTES) / sizeof(ATTRIBUTES[0]) == ATTRIBUTE_COUNT,
+		"ATTRIBUTES must match the Attributes enum");
 
 // as indexes to the type names
 const char *types[] = { "MppSensor", "MppSwitch", "MppMomentary", "MppAnalog",
@@ -60,73 +76,444 @@ bool isBatteryDevice(String udn) {
 		return false;
 }
 
+// with the dispatcher running the attributes and the subscriptions are
+// shared with its task, before that everything runs in the loop task
+#ifdef ESP_PLATFORM
+static SemaphoreHandle_t notifyLock = NULL;
+#endif
+
+static void lockNotify() {
+#ifdef ESP_PLATFORM
+	if (notifyLock != NULL)
+		xSemaphoreTake(notifyLock, portMAX_DELAY);
+#endif
+}
+
+static void unlockNotify() {
+#ifdef ESP_PLATFORM
+	if (notifyLock != NULL)
+		xSemaphoreGive(notifyLock);
+#endif
+}
+
+// fixed size table, a hash index on ip:port finds renewals and a min-heap
+// on the expiry time drops the expired ones.  All subscriptions last for
+// SUBSCRIPTION_TIME so the heap root is also the least recently renewed,
+// which makes room for a new one when the table is full.
+#define SUBSCRIPTION_INDEX (MAX_SUBSCRIPTIONS * 2)
+#define NO_SUBSCRIPTION 0xFF
+static_assert(MAX_SUBSCRIPTIONS < NO_SUBSCRIPTION, "slots are bytes");
+
 static class Subscriptions {
 public:
 	Subscriptions();
-	~Subscriptions();
-	void addSubscriber(const String &ip, int port = MPP_PORT);
-	void notifySubscribers(MppDevice *device);
+	void addSubscriber(const String &ip, int port = MPP_PORT, bool binary = false,
+			bool multicast = false);
+	void setMulticastGroup(IPAddress group, int port);
+	// from the dispatcher task the attributes are serialized under the lock,
+	// the cached json and deviceUdp belong to the loop task
+	void notifySubscribers(MppDevice *device, bool dispatched = false);
+	MppSubscriptionStats getStats();
 private:
 	struct Subscription {
 		char ip[18];
 		int port;
 		unsigned long expires;
+		bool binary; // cbor notifications
+		bool multicast; // a listener of the multicast group
+		uint8_t position; // in the heap
 	};
-	int count = 0;
-	Subscription *subscriptions;
+	Subscription subscriptions[MAX_SUBSCRIPTIONS];
+	// slots ordered by expiry in heap[0..count), the free ones follow
+	uint8_t heap[MAX_SUBSCRIPTIONS];
+	uint8_t index[SUBSCRIPTION_INDEX]; // open addressing, slot or NO_SUBSCRIPTION
+	unsigned count = 0;
+	unsigned long added = 0, expired = 0, evicted = 0;
+	IPAddress group; // for the listeners
+	int groupPort = 0;
 	NetworkUDP deviceUdp;
+	NetworkUDP taskUdp; // the dispatcher's
+	unsigned hash(const char *ip, int port);
+	unsigned find(const char *ip, int port); // index position, empty if absent
+	void unindex(uint8_t slot);
+	bool before(uint8_t a, uint8_t b); // a expires first
+	void place(unsigned position, uint8_t slot);
+	void siftUp(unsigned position);
+	void siftDown(unsigned position);
+	void remove(uint8_t slot);
+	void expire(unsigned long now);
 } subscriptions;
 
 Subscriptions::Subscriptions() {
-	subscriptions = (struct Subscription*) calloc(0,
-			sizeof(struct Subscription));
+	for (unsigned i = 0; i < MAX_SUBSCRIPTIONS; i++)
+		heap[i] = i;
+	memset(index, NO_SUBSCRIPTION, sizeof(index));
 }
 
-Subscriptions::~Subscriptions() {
-	free(subscriptions);
+// FNV-1a
+unsigned Subscriptions::hash(const char *ip, int port) {
+	uint32_t h = 2166136261u;
+	while (*ip)
+		h = (h ^ (uint8_t) *ip++) * 16777619u;
+	h = (h ^ (port & 0xFF)) * 16777619u;
+	h = (h ^ ((port >> 8) & 0xFF)) * 16777619u;
+	return h % SUBSCRIPTION_INDEX;
 }
 
-void Subscriptions::addSubscriber(const String &ip, int port) {
-	Subscription *subscription = NULL;
-	for (int i = 0; i < count; i++) {
-		if (strcmp(subscriptions[i].ip, ip.c_str()) == 0 && subscriptions[i].port == port) {
-			subscription = &subscriptions[i];
+unsigned Subscriptions::find(const char *ip, int port) {
+	unsigned at = hash(ip, port);
+	while (index[at] != NO_SUBSCRIPTION) {
+		Subscription &subscription = subscriptions[index[at]];
+		if (subscription.port == port && strcmp(subscription.ip, ip) == 0)
 			break;
-		}
+		at = (at + 1) % SUBSCRIPTION_INDEX;
+	}
+	return at;
+}
+
+// the rest of the probe run is reinserted so lookups don't stop at the gap
+void Subscriptions::unindex(uint8_t slot) {
+	unsigned at = find(subscriptions[slot].ip, subscriptions[slot].port);
+	index[at] = NO_SUBSCRIPTION;
+	for (at = (at + 1) % SUBSCRIPTION_INDEX; index[at] != NO_SUBSCRIPTION;
+			at = (at + 1) % SUBSCRIPTION_INDEX) {
+		uint8_t moved = index[at];
+		index[at] = NO_SUBSCRIPTION;
+		index[find(subscriptions[moved].ip, subscriptions[moved].port)] = moved;
+	}
+}
+
+// millis() wraps after 49 days
+bool Subscriptions::before(uint8_t a, uint8_t b) {
+	return (long) (subscriptions[a].expires - subscriptions[b].expires) < 0;
+}
+
+void Subscriptions::place(unsigned position, uint8_t slot) {
+	heap[position] = slot;
+	subscriptions[slot].position = position;
+}
+
+void Subscriptions::siftUp(unsigned position) {
+	uint8_t slot = heap[position];
+	while (position > 0) {
+		unsigned parent = (position - 1) / 2;
+		if (!before(slot, heap[parent]))
+			break;
+		place(position, heap[parent]);
+		position = parent;
 	}
-	if (subscription == NULL) {
-		++count;
-		subscriptions = (Subscription*) realloc(subscriptions,
-				count * sizeof(struct Subscription));
-		subscription = &subscriptions[count - 1];
-		strcpy(subscription->ip, ip.c_str());
-		subscription->port = port == 0 ? MPP_PORT : port;
-		Serial.printf("added subscriber %s:%d\n", subscription->ip,port);
+	place(position, slot);
+}
+
+void Subscriptions::siftDown(unsigned position) {
+	uint8_t slot = heap[position];
+	for (;;) {
+		unsigned child = 2 * position + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], slot))
+			break;
+		place(position, heap[child]);
+		position = child;
 	}
-	subscription->expires = millis() + SUBSCRIPTION_TIME; // 10m
-	Serial.printf("%s subscribed until %lu\n", subscription->ip,
-			subscription->expires);
+	place(position, slot);
+}
+
+void Subscriptions::remove(uint8_t slot) {
+	unindex(slot);
+	unsigned position = subscriptions[slot].position;
+	uint8_t last = heap[--count];
+	place(count, slot); // back with the free slots
+	if (position < count) {
+		place(position, last);
+		siftDown(position);
+		siftUp(subscriptions[last].position);
+	}
+}
+
+void Subscriptions::expire(unsigned long now) {
+	while (count > 0 && (long) (subscriptions[heap[0]].expires - now) <= 0) {
+		Serial.printf("subscription %s:%d expired\n", subscriptions[heap[0]].ip,
+				subscriptions[heap[0]].port);
+		remove(heap[0]);
+		expired++;
+	}
+}
+
+void Subscriptions::addSubscriber(const String &ip, int port, bool binary,
+		bool multicast) {
+	if (port == 0)
+		port = MPP_PORT;
+	lockNotify();
+	unsigned long now = millis();
+	expire(now);
+	unsigned at = find(ip.c_str(), port);
+	uint8_t slot = index[at];
+	if (slot == NO_SUBSCRIPTION) {
+		if (count == MAX_SUBSCRIPTIONS) {
+			Serial.printf("subscriptions full, dropped %s:%d\n",
+					subscriptions[heap[0]].ip, subscriptions[heap[0]].port);
+			remove(heap[0]);
+			evicted++;
+			at = find(ip.c_str(), port); // the probe run may have moved
+		}
+		slot = heap[count];
+		Subscription &subscription = subscriptions[slot];
+		snprintf(subscription.ip, sizeof(subscription.ip), "%s", ip.c_str());
+		subscription.port = port;
+		subscription.expires = now + SUBSCRIPTION_TIME;
+		index[at] = slot;
+		place(count++, slot);
+		siftUp(subscription.position);
+		added++;
+		Serial.printf("added subscriber %s:%d\n", subscription.ip, port);
+	} else {
+		subscriptions[slot].expires = now + SUBSCRIPTION_TIME; // renewed
+		siftDown(subscriptions[slot].position);
+	}
+	subscriptions[slot].binary = binary; // as last requested
+	subscriptions[slot].multicast = multicast;
+	Serial.printf("%s subscribed until %lu\n", subscriptions[slot].ip,
+			subscriptions[slot].expires);
+	unlockNotify();
+}
+
+MppSubscriptionStats Subscriptions::getStats() {
+	lockNotify();
+	expire(millis());
+	MppSubscriptionStats stats = { count, MAX_SUBSCRIPTIONS, added, expired,
+			evicted, 0 };
+	for (unsigned i = 0; i < count; i++)
+		if (subscriptions[heap[i]].multicast)
+			stats.listeners++;
+	unlockNotify();
+	return stats;
 }
 
-void Subscriptions::notifySubscribers(MppDevice *device) {
+void Subscriptions::setMulticastGroup(IPAddress group, int port) {
+	lockNotify();
+	this->group = group;
+	groupPort = port;
+	unlockNotify();
+}
+
+// the targets and payloads are copied under the lock, sent without it
+void Subscriptions::notifySubscribers(MppDevice *device, bool dispatched) {
 	if (eth_connected) {
-		unsigned long now = millis();
-		String message = device->getJson();
-		Serial.printf("Notifying with %s...\n", message.c_str());
-		for (int i = 0; i < count; i++) {
-			if (now < subscriptions[i].expires) {
-				deviceUdp.beginPacket(subscriptions[i].ip, subscriptions[i].port);
-				int result = deviceUdp.write((const uint8_t *)message.c_str(),message.length());
-				deviceUdp.endPacket();
-				yield(); // let the UDP notifications go (avoids loss during transmission)
-				Serial.printf("Sent notification to %s:%d (%d bytes sent)\n",
-						subscriptions[i].ip, subscriptions[i].port, result);
-			}
+		Subscription targets[MAX_SUBSCRIPTIONS];
+		unsigned targetCount = 0;
+		bool binary = false;
+		bool groupJson = false, groupCbor = false; // formats the listeners want
+		String snapshot;
+		// before the lock, refreshing the cache may set the location and
+		// set() takes the lock too
+		const String *json = dispatched ? &snapshot : &device->getJson();
+		lockNotify();
+		expire(millis());
+		IPAddress toGroup = group;
+		int toPort = groupPort;
+		for (unsigned i = 0; i < count; i++) {
+			Subscription &subscription = subscriptions[heap[i]];
+			binary |= subscription.binary;
+			if (subscription.multicast && toPort != 0) {
+				groupCbor |= subscription.binary;
+				groupJson |= !subscription.binary;
+			} else
+				targets[targetCount++] = subscription;
+		}
+		if (dispatched)
+			snapshot = device->refreshJson(); // a copy of the shared cache
+		unsigned cborLength = binary ? device->attributes.length(MPP_CBOR) : 0;
+		char cbor[cborLength + 1]; // only when someone wants it
+		if (binary)
+			device->attributes.toBuffer(cbor, sizeof(cbor), MPP_CBOR);
+		unlockNotify();
+		const char *message = json->c_str();
+		unsigned length = json->length();
+		NetworkUDP &udp = dispatched ? taskUdp : deviceUdp;
+		DEBUG_NOTIFY("Notifying with %s...\n", message);
+		for (unsigned i = 0; i < targetCount; i++) {
+			Subscription &subscription = targets[i];
+			udp.beginPacket(subscription.ip, subscription.port);
+			int result = subscription.binary ?
+					udp.write((const uint8_t *)cbor, cborLength) :
+					udp.write((const uint8_t *)message, length);
+			udp.endPacket();
+			yield(); // let the UDP notifications go (avoids loss during transmission)
+			DEBUG_NOTIFY("Sent notification to %s:%d (%d bytes sent)\n",
+					subscription.ip, subscription.port, result);
 		}
-		Serial.println("Notifications sent.");
+		// once for all the listeners, whatever their number
+		for (int format = 0; format < 2; format++) {
+			if (format == 0 ? !groupJson : !groupCbor)
+				continue;
+			udp.beginPacket(toGroup, toPort);
+			int result = format == 0 ?
+					udp.write((const uint8_t *)message, length) :
+					udp.write((const uint8_t *)cbor, cborLength);
+			udp.endPacket();
+			DEBUG_NOTIFY("Sent %s notification to group %s:%d (%d bytes sent)\n",
+					format == 0 ? "json" : "cbor", toGroup.toString().c_str(),
+					toPort, result);
+		}
+		DEBUG_NOTIFY("Notifications sent.\n");
 	}
 }
 
+// a bounded lock-free queue (Vyukov's) of changed devices, any task can post
+// and the dispatcher task is the only one taking.  A device is only queued
+// once until the dispatcher picks it up, later changes go with it.
+static_assert((MPP_NOTIFY_QUEUE & (MPP_NOTIFY_QUEUE - 1)) == 0,
+		"MPP_NOTIFY_QUEUE must be a power of 2");
+
+class MppDispatcher {
+public:
+	MppDispatcher();
+	bool start(unsigned stackSize, unsigned priority);
+	bool post(MppDevice *device);
+	MppNotifyStats getStats();
+	volatile bool running = false;
+private:
+	struct Pending {
+		std::atomic<unsigned> sequence; // the position it is ready for
+		MppDevice *device;
+		unsigned long changed; // micros
+	};
+	Pending pending[MPP_NOTIFY_QUEUE];
+	std::atomic<unsigned> head { 0 }, tail { 0 };
+	std::atomic<unsigned long> queued { 0 }, coalesced { 0 }, dropped { 0 };
+	std::atomic<unsigned> maxDepth { 0 };
+	// only updated by the task
+	std::atomic<unsigned long> sent { 0 }, lastLatency { 0 }, maxLatency { 0 },
+			averageLatency { 0 };
+#ifdef ESP_PLATFORM
+	TaskHandle_t task = NULL;
+#endif
+	bool take(MppDevice **device, unsigned long *changed);
+	void record(unsigned long latency); // a device sent
+	static void run(void *parameter);
+} dispatcher;
+
+MppDispatcher::MppDispatcher() {
+	for (unsigned i = 0; i < MPP_NOTIFY_QUEUE; i++)
+		pending[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool MppDispatcher::start(unsigned stackSize, unsigned priority) {
+#ifdef ESP_PLATFORM
+	if (running)
+		return true;
+	if (notifyLock == NULL)
+		notifyLock = xSemaphoreCreateMutex();
+	if (notifyLock == NULL
+			|| xTaskCreate(run, "mppNotify", stackSize, this, priority, &task)
+					!= pdPASS) {
+		Serial.println("Notification dispatcher not started");
+		return false;
+	}
+	running = true;
+	Serial.println("Notification dispatcher started");
+	return true;
+#else
+	(void) stackSize;
+	(void) priority;
+	return false;
+#endif
+}
+
+// false if the queue is full, the caller has to send it
+bool MppDispatcher::post(MppDevice *device) {
+	if (device->notifyQueued.exchange(true)) {
+		coalesced++;
+		return true;
+	}
+	unsigned position = head.load(std::memory_order_relaxed);
+	Pending *cell;
+	for (;;) {
+		cell = &pending[position & (MPP_NOTIFY_QUEUE - 1)];
+		int difference = (int) (cell->sequence.load(std::memory_order_acquire)
+				- position);
+		if (difference == 0) {
+			if (head.compare_exchange_weak(position, position + 1,
+					std::memory_order_relaxed))
+				break;
+		} else if (difference < 0) {
+			device->notifyQueued = false;
+			dropped++;
+			return false;
+		} else
+			position = head.load(std::memory_order_relaxed);
+	}
+	cell->device = device;
+	cell->changed = micros();
+	cell->sequence.store(position + 1, std::memory_order_release);
+	queued++;
+	unsigned depth = head.load(std::memory_order_relaxed)
+			- tail.load(std::memory_order_relaxed);
+	if (depth > maxDepth)
+		maxDepth = depth; // only a statistic, racing posts may lower it
+#ifdef ESP_PLATFORM
+	xTaskNotifyGive(task);
+#endif
+	return true;
+}
+
+bool MppDispatcher::take(MppDevice **device, unsigned long *changed) {
+	unsigned position = tail.load(std::memory_order_relaxed);
+	Pending *cell = &pending[position & (MPP_NOTIFY_QUEUE - 1)];
+	if ((int) (cell->sequence.load(std::memory_order_acquire) - (position + 1))
+			< 0)
+		return false; // empty
+	*device = cell->device;
+	*changed = cell->changed;
+	cell->sequence.store(position + MPP_NOTIFY_QUEUE, std::memory_order_release);
+	tail.store(position + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void MppDispatcher::record(unsigned long latency) {
+	unsigned long average = averageLatency;
+	lastLatency = latency;
+	if (latency > maxLatency)
+		maxLatency = latency;
+	// smoothed over the last 8 or so
+	averageLatency = ++sent == 1 ? latency :
+			average + ((long) latency - (long) average) / 8;
+}
+
+void MppDispatcher::run(void *parameter) {
+	MppDispatcher *self = (MppDispatcher*) parameter;
+	for (;;) {
+#ifdef ESP_PLATFORM
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+		MppDevice *device;
+		unsigned long changed;
+		while (self->take(&device, &changed)) {
+			device->notifyQueued = false; // changes from now on queue it again
+			subscriptions.notifySubscribers(device, true);
+			self->record(micros() - changed);
+		}
+	}
+}
+
+MppNotifyStats MppDispatcher::getStats() {
+	MppNotifyStats stats;
+	stats.async = running;
+	stats.depth = head.load() - tail.load();
+	stats.maxDepth = maxDepth;
+	stats.queued = queued;
+	stats.coalesced = coalesced;
+	stats.dropped = dropped;
+	stats.sent = sent;
+	stats.lastLatency = lastLatency;
+	stats.maxLatency = maxLatency;
+	stats.averageLatency = averageLatency;
+	return stats;
+}
+
 const String& getUID() {
   if(ETH.macAddress()=="00:00:00:00:00:00") {
     
@@ -152,51 +539,89 @@ String getDefaultUDN(Type t) {
 }
 
 MppDevice::MppDevice() {
+	attributes.internKeys(true);
+	attributes.pin(ATTRIBUTES, ATTRIBUTE_COUNT);
 }
 
 MppDevice::~MppDevice() {
 }
 
 const char* MppDevice::getUdn() {
-	return attributes.get("udn");
+	return attributes.getSlot(UDN);
 }
 
 const char* MppDevice::getName() {
-	return attributes.get("name");
+	return attributes.getSlot(NAME);
 }
 
 void MppDevice::begin(String udn, String name) {
 
   Serial.printf("Device UDN:%s begin MAC: %s,  IP :%s  \n",udn.c_str(),ETH.macAddress().c_str(), ETH.localIP().toString().c_str());
 	update(UDN, udn.c_str());
-	update("mac", ETH.macAddress());
+	update(MAC, ETH.macAddress());
 	update(NAME, name.c_str());
-	update("group", getUID().c_str());
+	update(GROUP, getUID().c_str());
 }
 
+// only formatted when the IP changes
 void MppDevice::setLocation() {
-//	if (_IP.length()>10)
-// TODO	if (ETH.localIP() && ETH.localIP().isSet())
-		set("location",
-				String("http://" + ETH.localIP().toString() + ":" + MPP_PORT).c_str());
+	IPAddress ip = ETH.localIP();
+	if (located && ip == locationIp)
+		return;
+	set(LOCATION, String("http://" + ip.toString() + ":" + MPP_PORT).c_str());
+	locationIp = ip;
+	located = true;
+}
+
+// any attribute change moves the sequence on.  The cache is only written
+// under the lock, the dispatcher copies it from there; attributes are only
+// changed by the loop task, so the cache it reads stays as it is
+const String& MppDevice::cachedJson() {
+	setLocation();
+	lockNotify();
+	refreshJson();
+	unlockNotify();
+	return json;
+}
+
+const String& MppDevice::refreshJson() {
+	uint32_t sequence = attributes.getSequence();
+	if (!jsonValid || sequence != jsonSequence) {
+		json = attributes.toString();
+		jsonSequence = sequence;
+		jsonValid = true;
+	}
+	return json;
 }
 
 // no notify
 bool MppDevice::clear(const char *key) {
+	bool result = false;
+	lockNotify();
 	if (attributes.contains(key)) {
 		attributes.remove(key);
-		return true;
-	} else
-		return false;
+		result = true;
+	}
+	unlockNotify();
+	return result;
 }
 
 bool MppDevice::clear(Attributes attribute) {
-	return clear(ATTRIBUTES[attribute]);
+	bool result = false;
+	lockNotify();
+	if (attributes.getSlot(attribute) != NULL) {
+		attributes.removeSlot(attribute);
+		result = true;
+	}
+	unlockNotify();
+	return result;
 }
 
 
+// the dispatcher task may be reading the attributes
 bool MppDevice::set(const char *key, const char *value) {
 	bool result = false;
+	lockNotify();
 	const char *oldValue = attributes.get(key);
 //	String temp = oldValue == NULL ? "null" : oldValue; // TEMP
 	if (value == NULL || strlen(value) == 0) {
@@ -209,12 +634,31 @@ bool MppDevice::set(const char *key, const char *value) {
 		result = true;
 	}
 //	Serial.printf("key=%s val=%s old=%s result=%d\n",key,(value == NULL ? "null" : value),temp.c_str(),result); // TODO
+	unlockNotify();
+	return result;
+}
+
+// array indexed, no key lookup
+bool MppDevice::set(Attributes attribute, const char *value) {
+	bool result = false;
+	lockNotify();
+	const char *oldValue = attributes.getSlot(attribute);
+	if (value == NULL || strlen(value) == 0) {
+		if (oldValue != NULL) {
+			attributes.removeSlot(attribute);
+			result = true;
+		}
+	} else if (oldValue == NULL || strcmp(oldValue, value) != 0) {
+		attributes.putSlot(attribute, value);
+		result = true;
+	}
+	unlockNotify();
 	return result;
 }
 
 // no notify
 bool MppDevice::update(Attributes attribute, const char* value) {
-	return set(ATTRIBUTES[attribute], value);
+	return set(attribute, value);
 }
 bool MppDevice::update(const char *key, const char* value) {
 	return set(key, value);
@@ -227,31 +671,123 @@ bool MppDevice::put(const char *key, const char* value) {
 	return result;
 }
 bool MppDevice::put(Attributes attribute, const char* value) {
-	return put(ATTRIBUTES[attribute], value);
+	bool result = set(attribute, value);
+	if (result)
+		notifySubscribers();
+	return result;
+}
+
+void MppDevice::beginUpdate() {
+	updating++;
+}
+
+bool MppDevice::commitUpdate() {
+	if (updating == 0 || --updating > 0 || !pending)
+		return false;
+	pending = false;
+	notifySubscribers();
+	return true;
 }
 
-// ArduinoJson needs to be refreshed as it leaks memory
-// take the opportunity to refresh it...
-const String MppDevice::getJson() {
+const String& MppDevice::getJson() {
+	return cachedJson();
+}
+
+// cbor is serialized on demand, it only goes to binary subscribers
+unsigned MppDevice::getJsonLength(MppFormat format) {
+	if (format == MPP_JSON)
+		return cachedJson().length();
 	setLocation();
-	return attributes.toString();
+	return attributes.length(format);
 }
 
-void MppDevice::addSubscriber(String ip, int port) {
-	Serial.printf("addSubscriber %s:%d\n", ip.c_str(),port);
-	subscriptions.addSubscriber(ip, port);
+size_t MppDevice::printJson(Print &out, MppFormat format) {
+	if (format == MPP_JSON) {
+		const String &cached = cachedJson();
+		return out.write((const uint8_t*) cached.c_str(), cached.length());
+	}
+	setLocation();
+	return attributes.printTo(out, format);
+}
+
+unsigned MppDevice::getJson(char *buffer, unsigned size, MppFormat format) {
+	if (format == MPP_JSON) {
+		const String &cached = cachedJson();
+		unsigned length = cached.length();
+		if (size > 0) {
+			unsigned copy = length < size ? length : size - 1;
+			memcpy(buffer, cached.c_str(), copy);
+			buffer[copy] = 0;
+		}
+		return length;
+	}
+	setLocation();
+	return attributes.toBuffer(buffer, size, format);
+}
+
+uint32_t MppDevice::getSequence() {
+	setLocation();
+	return attributes.getSequence();
+}
+
+bool MppDevice::changedSince(uint32_t sequence) {
+	setLocation();
+	return attributes.changedSince(sequence);
+}
+
+unsigned MppDevice::getDeltaLength(uint32_t since) {
+	setLocation();
+	return attributes.deltaLength(since);
+}
+
+size_t MppDevice::printDelta(Print &out, uint32_t since) {
+	setLocation();
+	return attributes.printDelta(out, since);
+}
+
+void MppDevice::addSubscriber(String ip, int port, bool binary,
+		bool multicast) {
+	Serial.printf("addSubscriber %s:%d%s%s\n", ip.c_str(), port,
+			binary ? " (cbor)" : "", multicast ? " (multicast)" : "");
+	subscriptions.addSubscriber(ip, port, binary, multicast);
+}
+
+MppSubscriptionStats MppDevice::getSubscriptionStats() {
+	return subscriptions.getStats();
+}
+
+void MppDevice::setMulticastGroup(IPAddress group, int port) {
+	subscriptions.setMulticastGroup(group, port);
+}
+
+bool MppDevice::startDispatcher(unsigned stackSize, unsigned priority) {
+	return dispatcher.start(stackSize, priority);
+}
+
+MppNotifyStats MppDevice::getNotifyStats() {
+	return dispatcher.getStats();
 }
 
 void MppDevice::notifySubscribers() {
+	if (updating > 0) {
+		pending = true; // sent by commitUpdate
+		return;
+	}
+	if (dispatcher.running) {
+		setLocation(); // here, the dispatcher only reads the attributes
+		if (dispatcher.post(this))
+			return;
+	}
 	subscriptions.notifySubscribers(this);
 }
 
 String MppDevice::get(Attributes attribute) {
-	return String(attributes.get(ATTRIBUTES[attribute]));
+	return String(attributes.getSlot(attribute));
 }
 
 bool MppDevice::has(Attributes attribute) {
-	return attributes.has(ATTRIBUTES[attribute]);
+	const char *value = attributes.getSlot(attribute);
+	return value != NULL && *value != 0;
 }
 
 void MppDevice::setActionHandler(
@@ -1,4 +1,5 @@
 #include <Arduino.h>
+#include <atomic>
 #include "Mpp32Parameters.h"
 #include "Mpp32Json.h"
 
@@ -21,6 +22,10 @@ For devices managed by AutomationManager (AM)
 
 // millis, 10m
 #define SUBSCRIPTION_TIME 1000 * 10 * 60
+// the least recently renewed subscription is dropped beyond this
+#ifndef MAX_SUBSCRIPTIONS
+#define MAX_SUBSCRIPTIONS 16
+#endif
 
 // optional parameters
 extern const char *P_LED_INVERT; // boolean
@@ -32,6 +37,7 @@ extern const char *P_SENSOR_PIN; // unsigned sensor pin
 extern const char *P_RELAY_PIN; // unsigned relay pin
 extern const char *P_INITIAL; // boolean startup state for relays
 extern const char *P_USE_LAST; // persist last state for startup
+extern const char *P_LAST_STATE; // boolean, last state for a power on with UseLast
 extern const char *P_IP_CHECK; // frequency of "network available" checks in hours
 extern const char *P_IP_ADDRESS; // target of network available connect request
 extern const char *P_IP_PORT; // port of network available connect request
@@ -66,7 +72,37 @@ enum Attributes {
 	UDN,
 	NAME,
 	GROUP,
-	CODE
+	CODE,
+	MAC,
+	LOCATION
+};
+#define ATTRIBUTE_COUNT (LOCATION + 1)
+
+struct MppSubscriptionStats {
+	unsigned count; // active subscriptions
+	unsigned capacity; // MAX_SUBSCRIPTIONS
+	unsigned long added;
+	unsigned long expired; // not renewed within SUBSCRIPTION_TIME
+	unsigned long evicted; // dropped for a new one when full
+	unsigned listeners; // of the multicast group
+};
+
+// devices changed faster than the dispatcher sends wait here once each
+#ifndef MPP_NOTIFY_QUEUE
+#define MPP_NOTIFY_QUEUE 16 // a power of 2
+#endif
+
+struct MppNotifyStats {
+	bool async; // sent by the dispatcher task
+	unsigned depth; // devices waiting
+	unsigned maxDepth;
+	unsigned long queued;
+	unsigned long coalesced; // changed again while waiting
+	unsigned long dropped; // queue full, sent by the caller instead
+	unsigned long sent;
+	unsigned long lastLatency; // micros from the change to the last send
+	unsigned long maxLatency;
+	unsigned long averageLatency;
 };
 
 // known/managed MppDevice types
@@ -122,10 +158,33 @@ public:
 	bool clear(Attributes attribute); // no notify
 	bool clear(const char *key); // no notify
 	String get(Attributes attribute);
-	const String getJson(); // get and refresh buffer
-	static void addSubscriber(String ip, int port = MPP_PORT);
+	const String& getJson(); // cached until an attribute or the IP changes
+	unsigned getJsonLength(MppFormat format = MPP_JSON); // exact length of getJson()
+	size_t printJson(Print& out, MppFormat format = MPP_JSON); // getJson() without building a String
+	unsigned getJson(char* buffer, unsigned size, MppFormat format = MPP_JSON); // returns the full length
+	uint32_t getSequence(); // snapshot for the deltas below
+	bool changedSince(uint32_t sequence);
+	unsigned getDeltaLength(uint32_t since);
+	size_t printDelta(Print& out, uint32_t since); // attributes changed after since
+	// binary subscribers are notified with the cbor form, multicast ones
+	// (listeners) by a single datagram to the multicast group
+	static void addSubscriber(String ip, int port = MPP_PORT, bool binary = false,
+			bool multicast = false);
+	// port 0 (the default) sends to the listeners one by one
+	static void setMulticastGroup(IPAddress group, int port);
+	static MppSubscriptionStats getSubscriptionStats();
+	// notifications are sent by a task instead of by put/notifySubscribers,
+	// a device changed again before it is sent goes out once
+	static bool startDispatcher(unsigned stackSize = 6144, unsigned priority = 1);
+	static MppNotifyStats getNotifyStats();
 	void notifySubscribers(); // use after update, put notifies automatically
 
+	// puts between beginUpdate and commitUpdate only mark the device changed,
+	// commit sends a single notification with the final state (may be nested,
+	// the outermost commit notifies), see MppDeviceUpdate
+	void beginUpdate();
+	bool commitUpdate(); // returns true if subscribers were notified
+
 	// the handler should return true if successful
 	// (allows use in sketch)
 	void setActionHandler(
@@ -145,8 +204,42 @@ protected:
 private:
 	// returns true if changed
 	bool set(const char *key, const char *value);
+	bool set(Attributes attribute, const char *value);
 	void setLocation();
+	const String& cachedJson();
+	const String& refreshJson(); // with the notify lock held
+	IPAddress locationIp; // of the LOCATION attribute
+	bool located = false;
+	String json; // serialized attributes
+	uint32_t jsonSequence = 0; // of the attributes serialized in json
+	bool jsonValid = false;
+	std::atomic<bool> notifyQueued { false }; // waiting for the dispatcher
+	friend class Subscriptions;
+	friend class MppDispatcher;
+	unsigned updating = 0; // beginUpdate depth
+	bool pending = false; // changed while updating
+	// well known attributes are pinned to slots indexed by the enum
 	MppJson attributes;
 };
 
+// scoped update, notifies once when it goes out of scope, e.g.
+//   {
+//     MppDeviceUpdate update(device);
+//     device.put(VALUE, value);
+//     device.put(STATE, "on");
+//   }
+class MppDeviceUpdate {
+public:
+	MppDeviceUpdate(MppDevice& device) : device(device) {
+		device.beginUpdate();
+	}
+	~MppDeviceUpdate() {
+		device.commitUpdate();
+	}
+	MppDeviceUpdate(const MppDeviceUpdate&) = delete;
+	MppDeviceUpdate& operator=(const MppDeviceUpdate&) = delete;
+private:
+	MppDevice& device;
+};
+
 #endif /* MPPDEVICE_H_ */
@@ -11,6 +11,74 @@ For devices managed by AutomationManager (AM)
  *
  */
 
+/******************************************************************************
+ * Last output states
+ *****************************************************************************/
+
+// RTC slow memory is not cleared by a software or watchdog reset, so the
+// outputs can be restored without writing to flash on every change.  After
+// a power on it holds garbage, the checksum rejects it.
+#define RTC_MAGIC 0x4D505052 // "MPPR"
+#define RTC_OUTPUTS 16
+
+struct RtcOutput {
+	uint8_t pin;
+	uint8_t state;
+	uint16_t level;
+};
+
+static RTC_NOINIT_ATTR struct {
+	uint32_t magic;
+	uint32_t checksum;
+	RtcOutput outputs[RTC_OUTPUTS];
+} rtcOutputs;
+
+static uint32_t rtcChecksum() {
+	uint32_t sum = RTC_MAGIC;
+	const uint8_t *bytes = (const uint8_t*) rtcOutputs.outputs;
+	for (unsigned i = 0; i < sizeof(rtcOutputs.outputs); i++)
+		sum = (sum << 5 | sum >> 27) ^ bytes[i];
+	return sum;
+}
+
+static RtcOutput* rtcOutput(unsigned pin, bool add) {
+	if (rtcOutputs.magic != RTC_MAGIC || rtcOutputs.checksum != rtcChecksum()) {
+		if (!add)
+			return NULL;
+		memset(rtcOutputs.outputs, 0xFF, sizeof(rtcOutputs.outputs));
+		rtcOutputs.magic = RTC_MAGIC;
+	}
+	RtcOutput *free = NULL;
+	for (unsigned i = 0; i < RTC_OUTPUTS; i++) {
+		if (rtcOutputs.outputs[i].pin == pin)
+			return &rtcOutputs.outputs[i];
+		if (free == NULL && rtcOutputs.outputs[i].pin == 0xFF)
+			free = &rtcOutputs.outputs[i];
+	}
+	if (free != NULL && add)
+		free->pin = pin;
+	return add ? free : NULL;
+}
+
+static void saveOutput(unsigned pin, bool state, unsigned level) {
+	RtcOutput *output = rtcOutput(pin, true);
+	if (output != NULL) {
+		output->state = state;
+		output->level = level;
+		rtcOutputs.checksum = rtcChecksum();
+	}
+}
+
+// false if nothing valid was saved for pin
+static bool restoreOutput(unsigned pin, bool *state, unsigned *level) {
+	RtcOutput *output = rtcOutput(pin, false);
+	if (output == NULL)
+		return false;
+	*state = output->state;
+	*level = output->level;
+	return true;
+}
+
 /******************************************************************************
  * MppSensor
  *****************************************************************************/
@@ -134,12 +202,27 @@ void MppRelay::begin() {
 	reportRelayState();
 }
 
+// restored right away, before the network is up
+bool MppRelay::setUseLast(bool useLast) {
+	bool state;
+	unsigned level;
+	this->useLast = useLast;
+	if (!useLast || !restoreOutput(pin, &state, &level))
+		return false;
+	Serial.printf("Relay on pin %d restored %s\n", pin, state ? "ON" : "OFF");
+	digitalWrite(pin, (relayInvert ? !state : state) ? HIGH : LOW);
+	reportRelayState();
+	return true;
+}
+
 void MppRelay::reportRelayState() {
 	// read and report the sensor state
 	bool relayState = digitalRead(pin) == HIGH;
 	if (relayInvert)
 		relayState = !relayState;
 	put(STATE, relayState ? "on" : "off");
+	if (useLast) // the state a momentary change returns to
+		saveOutput(pin, expires != 0 ? restoreState : relayState, 0);
 	// follow the relay state if configured
 	if (follow != pin) {
 		bool followState = ledInvert ? !relayState : relayState;
@@ -309,6 +392,19 @@ bool MppPWM::handleAction(String action, MppParameters parms) {
 	return handled ? true : MppDevice::handleAction(action, parms);
 }
 
+bool MppPWM::setUseLast(bool useLast) {
+	bool state;
+	unsigned level;
+	this->useLast = useLast;
+	if (!useLast || !restoreOutput(pin, &state, &level))
+		return false;
+	Serial.printf("PWM on pin %d restored %s at %u\n", pin,
+			state ? "ON" : "OFF", level);
+	this->level = level;
+	setState(state);
+	return true;
+}
+
 void MppPWM::setLevel(unsigned level) {
 	this->level = level;
 	if (state)
@@ -326,6 +422,8 @@ void MppPWM::notifyLevel() {
 	bool updated = false;
 	updated |= update(STATE, getState() ? "on" : "off");
 	updated |= update(VALUE, String(level).c_str());
+	if (useLast)
+		saveOutput(pin, state, level);
 	if (updated) {
 		notifySubscribers();
 		Serial.printf("Level=%s state=%s\n", get(VALUE).c_str(),
@@ -69,6 +69,11 @@ public:
 
 	bool getRelay();
 
+	// keep the relay state in RTC memory on every change (P_USE_LAST), call
+	// before setting the initial state, returns true if the state was
+	// restored (after a software or watchdog reset, not after a power on)
+	bool setUseLast(bool useLast);
+
   // ipCheckTime in minutes, port==0 use 80, returns true if check fails
   bool doIpCheck(unsigned ipCheckTime, String hostAddress, unsigned port);
 
@@ -84,6 +89,7 @@ private:
 	bool baseState, ledInvert = false, relayInvert = false;
 	unsigned long expires = 0;
 	bool restoreState = false;
+	bool useLast = false;
 	unsigned flashPeriod = 0;
 	unsigned long flashNext = 0;
 	void reportRelayState();
@@ -116,9 +122,16 @@ public:
 		return state;
 	}
 
+	// keep state and level in RTC memory, returns true if they were
+	// restored (after a software or watchdog reset).  A power on starts off,
+	// a sketch wanting more keeps a flash copy as the Mpp32Device example
+	// does for its relay
+	bool setUseLast(bool useLast);
+
 private:
 	unsigned pin = 0;
 	unsigned level = 0;bool state = false;
+	bool useLast = false;
 	void (*stateHandler)(bool state) = nullptr;
 
 	void notifyLevel();
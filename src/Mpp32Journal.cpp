@@ -0,0 +1,385 @@
+#include "Mpp32Journal.h"
+
+/*
+ * MppJournal.cpp FOR ESP32!!
+ *
+ * Sector: header (magic, sequence, reserved, crc of the first 12 bytes),
+ * then records until the erased (0xFF) space.
+ * Record: length of the payload (16 bit, little endian), type, flags, the
+ * payload, crc of all of it (32 bit), padded to 4 bytes.
+ * Payload: key and 0, value and 0 (SET unless null), key and 0 (REMOVE).
+ * A SNAPSHOT record followed by the complete set and a COMMIT record
+ * makes everything before it obsolete.
+ */
+
+#define JOURNAL_MAGIC 0x4A50504D // "MPPJ"
+#define JOURNAL_HEADER 16
+#define RECORD_HEADER 4
+#define RECORD_SET 1
+#define RECORD_REMOVE 2
+#define RECORD_SNAPSHOT 3
+#define RECORD_COMMIT 4
+#define RECORD_QUOTED 0x01
+#define RECORD_NULL 0x02
+
+// also used by MppPagedStore, here so the journal builds on a host
+uint32_t mppCrc32(const void *data, unsigned length, uint32_t crc) {
+	static const uint32_t nibbles[16] = { 0x00000000, 0x1DB71064, 0x3B6E20C8,
+			0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+			0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0,
+			0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+	const uint8_t *bytes = (const uint8_t*) data;
+	crc = ~crc;
+	while (length--) {
+		crc ^= *bytes++;
+		crc = (crc >> 4) ^ nibbles[crc & 0x0F];
+		crc = (crc >> 4) ^ nibbles[crc & 0x0F];
+	}
+	return ~crc;
+}
+
+static unsigned recordSize(unsigned length) {
+	return (RECORD_HEADER + length + sizeof(uint32_t) + 3) & ~3u;
+}
+
+/******************************************************************************
+ * MppRamFlash
+ *****************************************************************************/
+
+MppRamFlash::MppRamFlash(unsigned size, unsigned sectorSize) {
+	image = (uint8_t*) malloc(size);
+	imageSize = image == NULL ? 0 : size;
+	sector = sectorSize;
+	if (image != NULL)
+		memset(image, 0xFF, size);
+}
+
+MppRamFlash::~MppRamFlash() {
+	free(image);
+}
+
+bool MppRamFlash::read(unsigned offset, void *data, unsigned length) {
+	if (offset > imageSize || length > imageSize - offset)
+		return false;
+	memcpy(data, image + offset, length);
+	return true;
+}
+
+bool MppRamFlash::write(unsigned offset, const void *data, unsigned length) {
+	if (offset > imageSize || length > imageSize - offset)
+		return false;
+	const uint8_t *bytes = (const uint8_t*) data;
+	for (unsigned i = 0; i < length; i++)
+		image[offset + i] &= bytes[i]; // like NOR flash
+	return true;
+}
+
+bool MppRamFlash::erase(unsigned offset) {
+	if (offset >= imageSize)
+		return false;
+	offset -= offset % sector;
+	memset(image + offset, 0xFF, sector);
+	return true;
+}
+
+/******************************************************************************
+ * MppPartitionFlash
+ *****************************************************************************/
+
+#ifdef ESP_PLATFORM
+MppPartitionFlash::MppPartitionFlash(const char *label) {
+	this->label = label;
+}
+
+bool MppPartitionFlash::find() {
+	if (partition == NULL)
+		partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+				ESP_PARTITION_SUBTYPE_ANY, label);
+	return partition != NULL;
+}
+
+unsigned MppPartitionFlash::size() {
+	return find() ? partition->size : 0;
+}
+
+unsigned MppPartitionFlash::sectorSize() {
+	return find() ? partition->erase_size : 0;
+}
+
+bool MppPartitionFlash::read(unsigned offset, void *data, unsigned length) {
+	return find() && esp_partition_read(partition, offset, data, length) == ESP_OK;
+}
+
+bool MppPartitionFlash::write(unsigned offset, const void *data,
+		unsigned length) {
+	return find()
+			&& esp_partition_write(partition, offset, data, length) == ESP_OK;
+}
+
+bool MppPartitionFlash::erase(unsigned offset) {
+	return find()
+			&& esp_partition_erase_range(partition,
+					offset - offset % partition->erase_size,
+					partition->erase_size) == ESP_OK;
+}
+#endif
+
+/******************************************************************************
+ * MppJournalStore
+ *****************************************************************************/
+
+bool MppJournalStore::validSector(unsigned sector, uint32_t *sequence) {
+	uint32_t header[4];
+	if (!flash.read(sector * sectorSize, header, sizeof(header))
+			|| header[0] != JOURNAL_MAGIC || header[3] != mppCrc32(header, 12))
+		return false;
+	*sequence = header[1];
+	return true;
+}
+
+// finds the sectors in use: the one with the highest sequence and the
+// consecutive ones before it
+bool MppJournalStore::start() {
+	if (started)
+		return true;
+	sectorSize = flash.sectorSize();
+	sectors = sectorSize == 0 ? 0 : flash.size() / sectorSize;
+	if (sectors < 2) {
+		Serial.println("Journal partition missing or too small");
+		return false;
+	}
+	uint32_t current;
+	bool found = false;
+	for (unsigned sector = 0; sector < sectors; sector++) {
+		if (validSector(sector, &current)
+				&& (!found || (int32_t) (current - sequence) > 0)) {
+			sequence = current;
+			first = sector;
+			found = true;
+		}
+	}
+	used = found ? 1 : 0;
+	while (found && used < sectors) {
+		unsigned previous = (first + sectors - 1) % sectors;
+		if (!validSector(previous, &current) || current != sequence - used)
+			break;
+		first = previous;
+		++used;
+	}
+	offset = sectorSize; // until load() finds the end
+	started = true;
+	return true;
+}
+
+// reads the record at, returns the offset after it or 0 if there is none
+// (type 0 at the erased end, else a torn or corrupt record)
+unsigned MppJournalStore::next(unsigned sector, unsigned at, uint8_t *type,
+		uint8_t *flags, char *payload, unsigned *length) {
+	uint8_t header[RECORD_HEADER];
+	*type = 0xFF;
+	if (at + RECORD_HEADER > sectorSize
+			|| !flash.read(sector * sectorSize + at, header, sizeof(header)))
+		return 0;
+	if (header[0] == 0xFF && header[1] == 0xFF && header[2] == 0xFF
+			&& header[3] == 0xFF) {
+		*type = 0;
+		return 0;
+	}
+	*length = header[0] | header[1] << 8;
+	unsigned size = recordSize(*length);
+	uint32_t crc;
+	if (at + size > sectorSize
+			|| !flash.read(sector * sectorSize + at + RECORD_HEADER, payload,
+					*length)
+			|| !flash.read(sector * sectorSize + at + RECORD_HEADER + *length,
+					&crc, sizeof(crc))
+			|| crc
+					!= mppCrc32(payload, *length,
+							mppCrc32(header, RECORD_HEADER)))
+		return 0;
+	*type = header[2];
+	*flags = header[3];
+	return at + size;
+}
+
+bool MppJournalStore::load(MppJson &properties) {
+	if (!start() || used == 0)
+		return false; // nothing saved yet
+	char *payload = (char*) malloc(sectorSize);
+	if (payload == NULL)
+		return false;
+	uint8_t type = 0, flags;
+	unsigned length, at, after;
+	// where the last complete snapshot starts and the end of the log
+	unsigned snapshotIndex = 0, snapshotAt = JOURNAL_HEADER;
+	unsigned startIndex = 0, startAt = 0;
+	bool inSnapshot = false;
+	unsigned records = 0;
+	for (unsigned i = 0; i < used; i++) {
+		for (at = JOURNAL_HEADER;
+				(after = next(sectorAt(i), at, &type, &flags, payload, &length))
+						!= 0; at = after) {
+			++records;
+			if (type == RECORD_SNAPSHOT) {
+				inSnapshot = true;
+				startIndex = i;
+				startAt = at;
+			} else if (type == RECORD_COMMIT && inSnapshot) {
+				inSnapshot = false;
+				snapshotIndex = startIndex;
+				snapshotAt = startAt;
+			}
+		}
+		if (type != 0)
+			Serial.printf("Journal record at %u:%u ignored\n", sectorAt(i), at);
+	}
+	// a torn record closes the sector
+	offset = type == 0 ? at : sectorSize;
+	properties.clear();
+	for (unsigned i = snapshotIndex; i < used; i++) {
+		for (at = i == snapshotIndex ? snapshotAt : JOURNAL_HEADER;
+				(after = next(sectorAt(i), at, &type, &flags, payload, &length))
+						!= 0; at = after) {
+			if (length == 0 || payload[length - 1] != 0)
+				continue; // no key
+			unsigned keyLength = strlen(payload) + 1;
+			if (type == RECORD_SET)
+				properties.putText(payload,
+						flags & RECORD_NULL || keyLength >= length ?
+								NULL : payload + keyLength,
+						flags & RECORD_QUOTED);
+			else if (type == RECORD_REMOVE)
+				properties.remove(payload);
+		}
+	}
+	free(payload);
+	Serial.printf("Journal replayed %u records from %u sectors\n", records,
+			used);
+	return true;
+}
+
+bool MppJournalStore::openSector() {
+	if (sectors - used <= reserve)
+		return false; // full, or kept for the compaction
+	unsigned sector = sectorAt(used);
+	uint32_t header[4] = { JOURNAL_MAGIC, sequence + 1, 0xFFFFFFFF, 0 };
+	header[3] = mppCrc32(header, 12);
+	if (!flash.erase(sector * sectorSize)
+			|| !flash.write(sector * sectorSize, header, sizeof(header)))
+		return false;
+	++sequence;
+	++used;
+	offset = JOURNAL_HEADER;
+	checkSpace = true;
+	return true;
+}
+
+// header first, a cut before the crc is written leaves a torn record
+bool MppJournalStore::append(uint8_t type, uint8_t flags, const char *key,
+		const char *value) {
+	unsigned keyLength = key == NULL ? 0 : strlen(key) + 1;
+	unsigned valueLength = value == NULL ? 0 : strlen(value) + 1;
+	unsigned length = keyLength + valueLength;
+	unsigned size = recordSize(length);
+	if (JOURNAL_HEADER + size > sectorSize) {
+		Serial.printf("Journal record for %s too large\n", key);
+		return false;
+	}
+	if ((used == 0 || offset + size > sectorSize) && !openSector())
+		return false;
+	unsigned at = sectorAt(used - 1) * sectorSize + offset;
+	uint8_t header[RECORD_HEADER] = { (uint8_t) length, (uint8_t) (length >> 8),
+			type, flags };
+	uint32_t crc = mppCrc32(header, RECORD_HEADER);
+	crc = mppCrc32(value, valueLength, mppCrc32(key, keyLength, crc));
+	offset += size; // used even if the writes fail
+	return flash.write(at, header, RECORD_HEADER)
+			&& (keyLength == 0 || flash.write(at + RECORD_HEADER, key, keyLength))
+			&& (valueLength == 0
+					|| flash.write(at + RECORD_HEADER + keyLength, value,
+							valueLength))
+			&& flash.write(at + RECORD_HEADER + length, &crc, sizeof(crc));
+}
+
+// in fresh sectors, so all sectors before it can be erased
+bool MppJournalStore::appendSnapshot(MppJson &properties) {
+	offset = sectorSize;
+	if (!append(RECORD_SNAPSHOT, 0, NULL, NULL))
+		return false;
+	for (const _KV *current = properties.getFirst(); current != NULL;
+			current = properties.getNext(current))
+		if (!append(RECORD_SET,
+				(current->flags & KV_QUOTED ? RECORD_QUOTED : 0)
+						| (current->value == NULL ? RECORD_NULL : 0),
+				current->key, current->value))
+			return false;
+	return append(RECORD_COMMIT, 0, NULL, NULL);
+}
+
+unsigned MppJournalStore::snapshotSectors(MppJson &properties) {
+	unsigned count = 1;
+	unsigned at = JOURNAL_HEADER + recordSize(0);
+	for (const _KV *current = properties.getFirst(); current != NULL;
+			current = properties.getNext(current)) {
+		unsigned size = recordSize(strlen(current->key) + 1
+				+ (current->value == NULL ? 0 : strlen(current->value) + 1));
+		if (at + size > sectorSize) {
+			++count;
+			at = JOURNAL_HEADER;
+		}
+		at += size;
+	}
+	return at + recordSize(0) > sectorSize ? count + 1 : count;
+}
+
+bool MppJournalStore::compact(MppJson &properties) {
+	if (!start())
+		return false;
+	unsigned before = used;
+	unsigned oldFirst = first;
+	reserve = 0;
+	if (!appendSnapshot(properties)) {
+		Serial.println("Journal compaction failed, partition too small?");
+		return false;
+	}
+	for (unsigned i = 0; i < before; i++)
+		flash.erase(((oldFirst + i) % sectors) * sectorSize);
+	first = (oldFirst + before) % sectors;
+	used -= before;
+	checkSpace = false;
+	Serial.printf("Journal compacted, %u of %u sectors used\n", used, sectors);
+	return true;
+}
+
+bool MppJournalStore::save(MppJson &properties, uint32_t since) {
+	if (!start())
+		return false;
+	// removals that are no longer known need a snapshot
+	if (!properties.isDeltaComplete(since) || used == 0)
+		return compact(properties);
+	// appends leave room for the snapshot of a compaction
+	reserve = snapshotSectors(properties);
+	for (const _KV *current = properties.getNextChange(NULL, since);
+			current != NULL; current = properties.getNextChange(current, since)) {
+		bool appended =
+				current->flags & KV_ABSENT ?
+						append(RECORD_REMOVE, 0, current->key, NULL) :
+						append(RECORD_SET,
+								(current->flags & KV_QUOTED ? RECORD_QUOTED : 0)
+										| (current->value == NULL ?
+												RECORD_NULL : 0), current->key,
+								current->value);
+		if (!appended)
+			return compact(properties); // it has all the changes
+	}
+	return true;
+}
+
+void MppJournalStore::handle(MppJson &properties) {
+	if (started && checkSpace) {
+		checkSpace = false;
+		// well before the reserve is reached, off the save path
+		if (getFreeSectors() <= 2 * snapshotSectors(properties))
+			compact(properties);
+	}
+}
@@ -0,0 +1,104 @@
+#include <Arduino.h>
+#include "Mpp32PropertyStore.h"
+
+/*
+ * MppJournal.h FOR ESP32!!
+ *
+ * Crash-safe, log structured property store.  Changes are appended as CRC
+ * protected records to the sectors of a dedicated flash partition, used as
+ * a ring so the wear is spread over all of them.  At startup the records
+ * are replayed; a torn record from a power cut fails its CRC and is
+ * ignored.  When the free sectors run low a snapshot of the whole set is
+ * appended and the sectors before it are erased (compaction), which is
+ * only done after the snapshot is complete.
+ *
+ * The flash is accessed through MppFlash, MppRamFlash is an image in RAM
+ * so the format and replay can be tested on a host.
+ *
+ * To use it add a data partition to partitions.csv, e.g.
+ *   mppjournal, data, 0x99, , 0x10000,
+ * and define MPP_PROPERTIES_JOURNAL in config.h.
+ */
+
+#ifndef MPP_JOURNAL_H_
+#define MPP_JOURNAL_H_
+
+class MppFlash {
+public:
+	virtual ~MppFlash() {}
+	virtual unsigned size() = 0;
+	virtual unsigned sectorSize() = 0;
+	virtual bool read(unsigned offset, void* data, unsigned length) = 0;
+	// can only clear bits, erase sets the sector back to 0xFF
+	virtual bool write(unsigned offset, const void* data, unsigned length) = 0;
+	virtual bool erase(unsigned offset) = 0; // the sector at offset
+};
+
+// flash image in RAM
+class MppRamFlash: public MppFlash {
+public:
+	MppRamFlash(unsigned size, unsigned sectorSize = 4096);
+	~MppRamFlash();
+	unsigned size() { return imageSize; }
+	unsigned sectorSize() { return sector; }
+	bool read(unsigned offset, void* data, unsigned length);
+	bool write(unsigned offset, const void* data, unsigned length);
+	bool erase(unsigned offset);
+	uint8_t* getImage() { return image; } // e.g. to simulate a torn write
+private:
+	uint8_t* image;
+	unsigned imageSize;
+	unsigned sector;
+};
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+
+// a data partition found by its label
+class MppPartitionFlash: public MppFlash {
+public:
+	MppPartitionFlash(const char* label);
+	unsigned size();
+	unsigned sectorSize();
+	bool read(unsigned offset, void* data, unsigned length);
+	bool write(unsigned offset, const void* data, unsigned length);
+	bool erase(unsigned offset);
+private:
+	const char* label;
+	const esp_partition_t* partition = NULL;
+	bool find();
+};
+#endif
+
+class MppJournalStore: public MppPropertyStore {
+public:
+	MppJournalStore(MppFlash& flash) : flash(flash) {}
+	bool load(MppJson& properties);
+	bool save(MppJson& properties, uint32_t since);
+	void handle(MppJson& properties); // compacts when the free sectors run low
+	// appends a snapshot and erases the sectors before it
+	bool compact(MppJson& properties);
+	unsigned getFreeSectors() { return sectors - used; }
+private:
+	MppFlash& flash;
+	unsigned sectors = 0;
+	unsigned sectorSize = 0;
+	unsigned first = 0; // oldest sector in use
+	unsigned used = 0; // sectors in use, appending to the last one
+	uint32_t sequence = 0; // of the last sector
+	unsigned offset = 0; // append position in the last sector
+	unsigned reserve = 0; // free sectors appends must leave for a compaction
+	bool started = false;
+	bool checkSpace = false; // a sector was opened since the last check
+	bool start();
+	unsigned sectorAt(unsigned index) { return (first + index) % sectors; }
+	bool validSector(unsigned sector, uint32_t* sequence);
+	bool openSector();
+	bool append(uint8_t type, uint8_t flags, const char* key, const char* value);
+	bool appendSnapshot(MppJson& properties);
+	unsigned snapshotSectors(MppJson& properties);
+	unsigned next(unsigned sector, unsigned at, uint8_t* type, uint8_t* flags,
+			char* payload, unsigned* length);
+};
+
+#endif /* MPP_JOURNAL_H_ */
@@ -1,5 +1,7 @@
 #include "Mpp32Json.h"
 #include <stdlib.h>
+#include <math.h>
+#include <errno.h>
 
 /*
  * MppJson.cpp  FOR ESP32 !!
@@ -15,119 +17,770 @@ MppJson::MppJson() {
 
 const char *INVALID_JSON = "Invalid JSON";
 
-const char* MppJson::loadFrom(String newProperties) {
-	if (newProperties.length() < 2)
-		return "Invalid length";
-	else if (newProperties.charAt(0) != '{'
-			|| newProperties.charAt(newProperties.length() - 1) != '}')
-		return "Missing json delimiters";
-	else {
+static bool _isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static unsigned _digits(const char *text, unsigned length, unsigned i) {
+	unsigned start = i;
+	while (i < length && text[i] >= '0' && text[i] <= '9')
+		i++;
+	return i - start;
+}
+
+// bare values are kept as text, null is the only one stored as NULL
+// numbers follow the json grammar: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool _isLiteral(const char *text, unsigned length) {
+	if ((length == 4 && strncmp(text, "true", 4) == 0)
+			|| (length == 5 && strncmp(text, "false", 5) == 0))
+		return true;
+	unsigned i = 0, digits;
+	if (i < length && text[i] == '-')
+		i++;
+	if ((digits = _digits(text, length, i)) == 0
+			|| (digits > 1 && text[i] == '0'))
+		return false;
+	i += digits;
+	if (i < length && text[i] == '.') {
+		if ((digits = _digits(text, length, ++i)) == 0)
+			return false;
+		i += digits;
+	}
+	if (i < length && (text[i] == 'e' || text[i] == 'E')) {
+		if (++i < length && (text[i] == '+' || text[i] == '-'))
+			i++;
+		if ((digits = _digits(text, length, i)) == 0)
+			return false;
+		i += digits;
+	}
+	return i == length;
+}
+
+// decimal number text as the typed getters read it (a sign, leading zeros
+// and a bare '.' allowed), no hex, inf or nan.  integer if without a
+// fraction or exponent
+static bool _isDecimal(const char *text, bool *integer) {
+	unsigned length = strlen(text);
+	unsigned i = 0, digits;
+	if (text[i] == '-' || text[i] == '+')
+		i++;
+	digits = _digits(text, length, i);
+	i += digits;
+	*integer = true;
+	if (text[i] == '.') {
+		*integer = false;
+		unsigned fraction = _digits(text, length, ++i);
+		i += fraction;
+		digits += fraction;
+	}
+	if (digits == 0)
+		return false;
+	if (text[i] == 'e' || text[i] == 'E') {
+		*integer = false;
+		if (text[++i] == '+' || text[i] == '-')
+			i++;
+		if ((digits = _digits(text, length, i)) == 0)
+			return false;
+		i += digits;
+	}
+	return i == length;
+}
+
+static int _hex(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// decodes json string escapes in place, returns the new length
+// (the parser has checked them with _escapeLength)
+static unsigned _unescape(char *text, unsigned length) {
+	unsigned out = 0;
+	for (unsigned i = 0; i < length; i++) {
+		char c = text[i];
+		if (c == '\\' && i + 1 < length) {
+			c = text[++i];
+			switch (c) {
+			case 'b':
+				c = '\b';
+				break;
+			case 'f':
+				c = '\f';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'u': {
+				unsigned code = 0;
+				for (unsigned x = 1; x <= 4 && i + x < length; x++)
+					code = (code << 4) | (_hex(text[i + x]) & 0xF);
+				i += 4;
+				// utf-8, surrogate pairs are not combined
+				if (code < 0x80)
+					c = code;
+				else {
+					if (code < 0x800)
+						text[out++] = 0xC0 | (code >> 6);
+					else {
+						text[out++] = 0xE0 | (code >> 12);
+						text[out++] = 0x80 | ((code >> 6) & 0x3F);
+					}
+					c = 0x80 | (code & 0x3F);
+				}
+				break;
+			}
+			}
+		}
+		text[out++] = c;
+	}
+	return out;
+}
+
+// length of a valid escape at text (after the '\\'), 0 if invalid
+static unsigned _escapeLength(const char *text, unsigned length) {
+	if (length == 0)
+		return 0;
+	if (*text != 0 && strchr("\"\\/bfnrt", *text) != NULL)
+		return 1;
+	if (*text != 'u' || length < 5)
+		return 0;
+	unsigned code = 0;
+	for (unsigned x = 1; x <= 4; x++) {
+		int digit = _hex(text[x]);
+		if (digit < 0)
+			return 0;
+		code = (code << 4) | digit;
+	}
+	return code == 0 ? 0 : 5; // values are C strings
+}
+
+const char* MppJson::loadFrom(const String newProperties) {
+	return loadFrom(newProperties.c_str(), newProperties.length());
+}
+
+const char* MppJson::loadFrom(const char *data, unsigned length,
+		unsigned *errorOffset, MppFormat format) {
+	return format == MPP_CBOR ?
+			_loadCbor(data, length, errorOffset) :
+			_loadJson(data, length, errorOffset);
+}
+
+// single pass over the buffer, key and value text is copied straight into the arena
+const char* MppJson::_loadJson(const char *json, unsigned length,
+		unsigned *errorOffset) {
+	enum {
+		OPEN, KEY_OR_END, KEY, COLON, VALUE, STRING, LITERAL, COMMA_OR_END, DONE
+	} state = OPEN;
+	const char *error = nullptr;
+	const char *key = NULL, *value = NULL;
+	unsigned keyLength = 0;
+	bool keyEscaped = false, escaped = false, escape = false;
+	unsigned i = 0;
+	if (length < 2)
+		error = "Invalid length";
+	else
 		clear();
-		unsigned i = 1;
-		while (i < newProperties.length() - 1) {
-			//			Serial.printf("now parsing '%s'...\n",newProperties.substring(i).c_str());
-			int key1 = newProperties.indexOf('"', i);
-			if (key1 == -1)
-				return INVALID_JSON;
-			++key1;
-			int key2 = newProperties.indexOf('"', key1);
-			if (key2 == -1)
-				return INVALID_JSON;
-			String key = newProperties.substring(key1, key2);
-			int val1 = newProperties.indexOf(':', key2 + 1);
-			if (val1 == -1)
-				return INVALID_JSON;
-			if (newProperties.substring(val1 + 1).startsWith("\"")) {
-				// handle as string, remove quotes
-				val1 = newProperties.indexOf('"', val1 + 1);
-				if (val1 == -1)
-					return INVALID_JSON;
-				++val1;
-				int val2 = newProperties.indexOf('"', val1);
-				if (val2 == -1)
-					return INVALID_JSON;
-				String val = newProperties.substring(val1, val2);
-				put(key.c_str(), val.c_str());
-				i = val2 + 1;
-				//				Serial.printf("found '%s'='%s' now at %d\n", key.c_str(),
-				//						val.c_str(), i);
-			} else if (newProperties.substring(val1 + 1).startsWith("null")) {
-				put(key.c_str(), NULL);
-				i = val1 + 5;
-				//				Serial.printf("found '%s'=null now at %d\n", key.c_str(), i);
-			} else {
-				// handle as string
-				++val1;
-				int val2 = newProperties.indexOf(',', val1);
-				if (val2 == -1)
-					return INVALID_JSON;
-				String val = newProperties.substring(val1, val2);
-				put(key.c_str(), val.c_str());
-				i = val2 + 1;
-				//				Serial.printf("found '%s'='%s' now at %d\n", key.c_str(),
-				//						val.c_str(), i);
+	for (; error == nullptr && i <= length; i++) {
+		char c = i < length ? json[i] : 0; // 0 flushes a trailing literal
+		switch (state) {
+		case OPEN:
+			if (c == '{')
+				state = KEY_OR_END;
+			else if (!_isSpace(c))
+				error = "Missing json delimiters";
+			break;
+		case KEY_OR_END:
+			if (c == '"') {
+				key = json + i + 1;
+				keyEscaped = false;
+				state = KEY;
+			} else if (c == '}' && size() == 0)
+				state = DONE;
+			else if (!_isSpace(c))
+				error = "Expected key";
+			break;
+		case KEY:
+		case STRING:
+			if (escape) {
+				unsigned escapeLength = _escapeLength(json + i, length - i);
+				if (escapeLength == 0)
+					error = "Invalid escape";
+				else
+					i += escapeLength - 1;
+				escape = false;
+			} else if (c == '\\') {
+				escape = true;
+				if (state == KEY)
+					keyEscaped = true;
+				else
+					escaped = true;
+			}
+			else if (c == 0)
+				error = "Unterminated string";
+			else if (c == '"') {
+				if (state == KEY) {
+					keyLength = json + i - key;
+					if (keyLength > MPP_KEY_MAX)
+						error = "Key too long";
+					state = COLON;
+				} else {
+					if (!_put(key, keyLength, keyEscaped, value, json + i - value,
+							escaped, true))
+						error = "Out of memory";
+					state = COMMA_OR_END;
+				}
+			}
+			break;
+		case COLON:
+			if (c == ':')
+				state = VALUE;
+			else if (!_isSpace(c))
+				error = "Expected ':'";
+			break;
+		case VALUE:
+			if (c == '"') {
+				value = json + i + 1;
+				escaped = false;
+				state = STRING;
+			} else if (c == '{' || c == '[')
+				error = "Nested values not supported";
+			else if (c == ',' || c == '}' || c == 0)
+				error = "Expected value";
+			else if (!_isSpace(c)) {
+				value = json + i;
+				state = LITERAL;
+			}
+			break;
+		case LITERAL:
+			if (c == ',' || c == '}' || _isSpace(c) || c == 0) {
+				unsigned valueLength = json + i - value;
+				if (valueLength == 4 && strncmp(value, "null", 4) == 0)
+					value = NULL;
+				else if (!_isLiteral(value, valueLength)) {
+					i = value - json;
+					error = "Invalid literal";
+					break;
+				}
+				if (!_put(key, keyLength, keyEscaped, value, valueLength, false,
+						false))
+					error = "Out of memory";
+				state = COMMA_OR_END;
+				--i; // reprocess the delimiter
 			}
-			if (newProperties.charAt(i) == ',')
-				++i;
+			break;
+		case COMMA_OR_END:
+			if (c == ',')
+				state = KEY_OR_END;
+			else if (c == '}')
+				state = DONE;
+			else if (!_isSpace(c))
+				error = "Expected ',' or '}'";
+			break;
+		case DONE:
+			if (c != 0 && !_isSpace(c))
+				error = "Unexpected data after '}'";
+			break;
 		}
-		return nullptr;
 	}
+	if (error == nullptr && state != DONE)
+		error = state == OPEN ? "Missing json delimiters" : INVALID_JSON;
+	if (errorOffset != NULL)
+		*errorOffset = error == nullptr || i == 0 ? 0 : i - 1;
+	return error;
+}
+
+bool MppJson::_put(const char *key, unsigned keyLength, bool keyEscaped,
+		const char *value, unsigned length, bool escaped, bool quoted) {
+	if (keyEscaped) {
+		char unescaped[MPP_KEY_MAX + 1];
+		if (keyLength > MPP_KEY_MAX)
+			return false;
+		memcpy(unescaped, key, keyLength);
+		keyLength = _unescape(unescaped, keyLength);
+		return _put(unescaped, keyLength, false, value, length, escaped, quoted);
+	}
+	// bare literals keep their json type
+	_KV *current = _set(_get(key, keyLength), value, length, quoted);
+	if (current != NULL && escaped) {
+		current->value[_unescape(current->value, length)] = 0;
+		_classify(current);
+	}
+	return current != NULL;
 }
 
 MppJson::~MppJson() {
-	clear();
+	free(_arena);
 }
 
-_KV* MppJson::_find(const char *key) {
-	_KV *current = _properties;
-	while (current != NULL) {
-		if (strcmp(current->key, key) == 0)
+// FNV-1a
+static uint32_t _hash(const char *key, unsigned length) {
+	uint32_t hash = 2166136261u;
+	while (length--)
+		hash = (hash ^ (uint8_t) *key++) * 16777619u;
+	return hash;
+}
+
+/*
+ * Process wide key table, entries of long lived sets refer to an interned
+ * key so identical keys (attribute and property names) are stored once.
+ * Keys registered with intern() are used in place, others are copied into
+ * a key pool.  Interned keys are never released, sets without internKeys
+ * only look keys up.
+ */
+#define KEY_POOL_CHUNK 256
+
+static struct {
+	const char** keys = NULL; // open addressed
+	uint32_t* hashes = NULL;
+	unsigned size = 0; // power of 2
+	unsigned count = 0;
+	char* pool = NULL;
+	unsigned poolFree = 0;
+} _interned;
+
+static unsigned _allocations = 0;
+
+static const char* _lookupKey(const char *key, unsigned length,
+		uint32_t hash, unsigned *at) {
+	if (_interned.size == 0)
+		return NULL;
+	unsigned slot = hash & (_interned.size - 1);
+	while (_interned.keys[slot] != NULL) {
+		const char *current = _interned.keys[slot];
+		if (_interned.hashes[slot] == hash
+				&& (current == key
+						|| (strncmp(current, key, length) == 0
+								&& current[length] == 0)))
 			return current;
-		current = current->next;
+		slot = (slot + 1) & (_interned.size - 1);
 	}
+	if (at != NULL)
+		*at = slot;
 	return NULL;
 }
 
-_KV* MppJson::_get(const char *key) {
-	_KV *current = _find(key);
+// returns the interned key, NULL if out of memory
+static const char* _internKey(const char *key, unsigned length, uint32_t hash,
+		bool copy) {
+	const char *found = _lookupKey(key, length, hash, NULL);
+	if (found != NULL)
+		return found;
+	if (_interned.count * 2 >= _interned.size) {
+		// grow and rehash
+		unsigned size = _interned.size == 0 ? 64 : _interned.size * 2;
+		const char **keys = (const char**) calloc(size, sizeof(const char*));
+		uint32_t *hashes = (uint32_t*) malloc(size * sizeof(uint32_t));
+		if (keys == NULL || hashes == NULL) {
+			free(keys);
+			free(hashes);
+			return NULL;
+		}
+		_allocations += 2;
+		for (unsigned i = 0; i < _interned.size; i++) {
+			if (_interned.keys[i] == NULL)
+				continue;
+			unsigned slot = _interned.hashes[i] & (size - 1);
+			while (keys[slot] != NULL)
+				slot = (slot + 1) & (size - 1);
+			keys[slot] = _interned.keys[i];
+			hashes[slot] = _interned.hashes[i];
+		}
+		free(_interned.keys);
+		free(_interned.hashes);
+		_interned.keys = keys;
+		_interned.hashes = hashes;
+		_interned.size = size;
+	}
+	unsigned slot;
+	_lookupKey(key, length, hash, &slot);
+	if (copy) {
+		if (length + 1 > _interned.poolFree) {
+			unsigned chunk = length + 1 > KEY_POOL_CHUNK ? length + 1 : KEY_POOL_CHUNK;
+			_interned.pool = (char*) malloc(chunk);
+			if (_interned.pool == NULL) {
+				_interned.poolFree = 0;
+				return NULL;
+			}
+			++_allocations;
+			_interned.poolFree = chunk;
+		}
+		char *text = _interned.pool;
+		memcpy(text, key, length);
+		text[length] = 0;
+		_interned.pool += length + 1;
+		_interned.poolFree -= length + 1;
+		key = text;
+	}
+	_interned.keys[slot] = key;
+	_interned.hashes[slot] = hash;
+	++_interned.count;
+	return key;
+}
+
+const char* MppJson::intern(const char *key) {
+	unsigned length = strlen(key);
+	return _internKey(key, length, _hash(key, length), false);
+}
+
+unsigned MppJson::internedKeys() {
+	return _interned.count;
+}
+
+unsigned MppJson::heapAllocations() {
+	return _allocations;
+}
+
+// arena text is handed out in 4 byte units
+static unsigned _round(unsigned length) {
+	return (length + 3) & ~3u;
+}
+
+char* MppJson::_alloc(unsigned length) {
+	length = _round(length);
+	if (_text == NULL || _textUsed + length > _textSize)
+		return NULL;
+	char *result = _text + _textUsed;
+	_textUsed += length;
+	_textLive += length;
+	return result;
+}
+
+bool MppJson::_owns(const char *text) {
+	return _arena != NULL && text >= _arena && text < _text + _textSize;
+}
+
+// allocates a new arena with room for the live entries and text plus the
+// additional entries and text, copies the live entries (compacting removed ones)
+bool MppJson::_rebuild(unsigned entries, unsigned text, _KV **track) {
+	for (unsigned i = 0; i < _used; i++)
+		if (!_dropped(i) || (track != NULL && *track == &_entries[i]))
+			++entries;
+	text += _textLive;
+	unsigned capacity = _capacity < 4 ? 4 : _capacity;
+	while (capacity < entries)
+		capacity *= 2;
+	unsigned textSize = _textSize < 64 ? 64 : _textSize;
+	while (textSize < text + text / 4)
+		textSize *= 2;
+	unsigned indexSize = capacity * 2;
+	if (indexSize > 0xFFFF)
+		return false;
+	char *arena = (char*) malloc(
+			capacity * sizeof(_KV) + indexSize * sizeof(uint16_t) + textSize);
+	if (arena == NULL) {
+		Serial.println("MppJson: out of memory");
+		return false;
+	}
+	++_allocations;
+	char *oldArena = _arena;
+	_KV *oldEntries = _entries;
+	unsigned oldUsed = _used;
+	_arena = arena;
+	_entries = (_KV*) arena;
+	_index = (uint16_t*) (arena + capacity * sizeof(_KV));
+	_text = (char*) (_index + indexSize);
+	memset(_index, 0, indexSize * sizeof(uint16_t));
+	_capacity = capacity;
+	_indexSize = indexSize;
+	_textSize = textSize;
+	_used = 0;
+	_textUsed = 0;
+	_textLive = 0;
+	for (unsigned i = 0; i < oldUsed; i++) {
+		_KV *old = &oldEntries[i];
+		// the tracked entry is about to get a value again
+		if ((old->flags & KV_ABSENT) && i >= _pinned
+				&& (track == NULL || *track != old)) {
+			// removed, deltas from before now need a full update
+			_compacted = _sequence;
+			continue;
+		}
+		_KV *current = &_entries[_used];
+		*current = *old;
+		current->value = NULL;
+		if (old->flags & KV_OWN_KEY) {
+			char *key = _alloc(strlen(old->key) + 1);
+			strcpy(key, old->key);
+			current->key = key;
+		}
+		if (old->flags & KV_INLINE)
+			current->value = current->small;
+		else if (old->value != NULL) {
+			current->value = _alloc(old->capacity);
+			strcpy(current->value, old->value);
+		}
+		unsigned slot = current->hash & (_indexSize - 1);
+		while (_index[slot] != 0)
+			slot = (slot + 1) & (_indexSize - 1);
+		_index[slot] = ++_used;
+		if (track != NULL && *track == old)
+			*track = current;
+	}
+	free(oldArena);
+	return true;
+}
+
+// slot is set to the matching or first free index slot
+_KV* MppJson::_find(const char *key, unsigned length, uint32_t hash,
+		unsigned *slot) {
+	if (_indexSize == 0)
+		return NULL;
+	unsigned i = hash & (_indexSize - 1);
+	while (_index[i] != 0) {
+		_KV *current = &_entries[_index[i] - 1];
+		// removed entries stay in the index (as absent) until the next
+		// rebuild, interned keys usually match by pointer
+		if (current->hash == hash
+				&& (current->key == key
+						|| (strncmp(current->key, key, length) == 0
+								&& current->key[length] == 0))) {
+			if (slot != NULL)
+				*slot = i;
+			return current;
+		}
+		i = (i + 1) & (_indexSize - 1);
+	}
+	if (slot != NULL)
+		*slot = i;
+	return NULL;
+}
+
+_KV* MppJson::_find(const char *key) {
+	unsigned length = strlen(key);
+	return _find(key, length, _hash(key, length), NULL);
+}
+
+// finds the entry or adds it as absent, _set makes it part of the set
+_KV* MppJson::_get(const char *key, unsigned length) {
+	uint32_t hash = _hash(key, length);
+	unsigned slot;
+	_KV *current = _find(key, length, hash, &slot);
 	if (current == NULL) {
-		current = (_KV*) malloc(sizeof(_KV));
-		current->key = (char*) malloc(strlen(key) + 1);
-		strcpy(current->key, key);
+		const char *interned = _internKeys ?
+				_internKey(key, length, hash, true) :
+				_lookupKey(key, length, hash, NULL);
+		if (interned == NULL && _internKeys)
+			return NULL;
+		// an own key is copied into the arena, which needs room for it
+		unsigned keyText = interned == NULL ? _round(length + 1) : 0;
+		if (_used == _capacity || _textUsed + keyText > _textSize) {
+			if (!_rebuild(1, keyText, NULL))
+				return NULL;
+			_find(key, length, hash, &slot);
+		}
+		current = &_entries[_used];
+		current->flags = KV_ABSENT; // until _set gives it a value
+		if (interned == NULL) {
+			char *text = _alloc(length + 1);
+			memcpy(text, key, length);
+			text[length] = 0;
+			interned = text;
+			current->flags |= KV_OWN_KEY;
+		}
+		current->key = interned;
 		current->value = NULL;
-		current->next = _properties;
-		_properties = current;
+		current->hash = hash;
+		current->capacity = 0;
+		current->type = KV_NULL;
+		current->number.i = 0;
+		current->changed = 0;
+		_index[slot] = ++_used;
 	}
 	return current;
 }
 
 void MppJson::remove(const char *key) {
-	_KV *current = _find(key);
-	if (current != NULL) {
-		if (_properties == current) {
-			_properties = current->next;
+	_remove(_find(key));
+}
+
+// removed entries keep their (interned) key so the removal shows in a delta,
+// unless pinned they are compacted away by the next rebuild
+void MppJson::_remove(_KV *current) {
+	if (current == NULL || (current->flags & KV_ABSENT))
+		return;
+	_release(current);
+	current->type = KV_NULL;
+	current->flags |= KV_ABSENT;
+	current->changed = ++_sequence;
+	--_size;
+}
+
+// arena text is reclaimed by the next rebuild
+void MppJson::_release(_KV *current) {
+	if (!(current->flags & KV_INLINE))
+		_textLive -= current->capacity;
+	current->flags &= ~KV_INLINE;
+	current->value = NULL;
+	current->capacity = 0;
+}
+
+bool MppJson::_dropped(unsigned entry) {
+	return (_entries[entry].flags & KV_ABSENT) && entry >= _pinned;
+}
+
+// value must not be in the arena, returns the (possibly moved) entry or
+// NULL if out of memory
+_KV* MppJson::_set(_KV *current, const char *value, unsigned length,
+		bool quoted) {
+	if (current == NULL)
+		return NULL;
+	if (!(current->flags & KV_ABSENT)
+			&& quoted == ((current->flags & KV_QUOTED) != 0)
+			&& (value == NULL ?
+					current->value == NULL :
+					current->value != NULL
+							&& strncmp(current->value, value, length) == 0
+							&& current->value[length] == 0))
+		return current; // unchanged
+	if (value != NULL && length + 1 > 0xFFFF)
+		return NULL;
+	if (value != NULL && length < KV_INLINE_SIZE) {
+		// short values live in the entry, no arena text
+		if (!(current->flags & KV_INLINE)) {
+			_release(current);
+			current->value = current->small;
+			current->capacity = KV_INLINE_SIZE;
+			current->flags |= KV_INLINE;
+		}
+	} else if (value != NULL && length + 1 > current->capacity) {
+		// does not fit in place
+		_release(current);
+		char *text = _alloc(length + 1);
+		if (text == NULL) {
+			if (!_rebuild(0, _round(length + 1), &current))
+				return NULL;
+			text = _alloc(length + 1);
+		}
+		current->value = text;
+		current->capacity = _round(length + 1);
+	}
+	if (value != NULL) {
+		memcpy(current->value, value, length);
+		current->value[length] = 0;
+	} else if (current->value != NULL)
+		_release(current);
+	if (current->flags & KV_ABSENT) {
+		current->flags &= ~KV_ABSENT;
+		++_size;
+	}
+	if (quoted)
+		current->flags |= KV_QUOTED;
+	else
+		current->flags &= ~KV_QUOTED;
+	_classify(current);
+	current->changed = ++_sequence;
+	return current;
+}
+
+// caches the numeric/boolean form of the value text so the typed getters
+// do not need to parse
+void MppJson::_classify(_KV *current) {
+	const char *value = current->value;
+	bool integer;
+	current->number.i = 0;
+	current->type = KV_STRING; // also numbers out of range, read from the text
+	if (value == NULL)
+		current->type = KV_NULL;
+	else if (strcasecmp(value, "true") == 0 || strcasecmp(value, "false") == 0) {
+		current->type = KV_BOOL;
+		current->number.i = tolower(*value) == 't';
+	} else if (_isDecimal(value, &integer)) {
+		errno = 0;
+		if (integer) {
+			long long number = strtoll(value, NULL, 10);
+			if (errno == 0 && number == (int32_t) number) {
+				current->type = KV_INT;
+				current->number.i = number;
+			}
 		} else {
-			_KV *previous = _properties;
-			while (previous->next != current)
-				previous = previous->next;
-			previous->next = current->next;
+			float real = strtof(value, NULL);
+			if (errno == 0) {
+				current->type = KV_FLOAT;
+				current->number.f = real;
+			}
 		}
-		free(current->key);
-		if (current->value)
-			free(current->value);
-		free(current);
 	}
 }
 
+void MppJson::_put(const char *key, const char *value, bool quoted) {
+	unsigned length = value == NULL ? 0 : strlen(value);
+	if (value != NULL && _owns(value)) {
+		// the arena may move, use a copy
+		char copy[length + 1];
+		memcpy(copy, value, length + 1);
+		return _put(key, copy, quoted);
+	}
+	_set(_get(key, strlen(key)), value, length, quoted);
+}
+
 void MppJson::put(const char *key, const char *value) {
-	_KV *current = _get(key);
-	if (current->value != NULL)
-		free(current->value);
-	if (value != NULL) {
-		current->value = (char*) malloc(strlen(value) + 1);
-		strcpy(current->value, value);
-	} else
-		current->value = NULL;
+	_put(key, value, true);
+}
+
+void MppJson::putText(const char *key, const char *value, bool quoted) {
+	_put(key, value,
+			quoted || (value != NULL && !_isLiteral(value, strlen(value))));
+}
+
+void MppJson::putInt(const char *key, int value) {
+	char text[12];
+	snprintf(text, sizeof(text), "%d", value);
+	_put(key, text, false);
+}
+
+void MppJson::putFloat(const char *key, float value, unsigned decimals) {
+	char text[24];
+	snprintf(text, sizeof(text), "%.*f", decimals, value);
+	_put(key, text, !_isLiteral(text, strlen(text))); // nan and inf as strings
+}
+
+void MppJson::putBool(const char *key, bool value) {
+	_put(key, value ? "true" : "false", false);
+}
+
+void MppJson::pin(const char *const keys[], unsigned count) {
+	_pinnedKeys = keys;
+	_pinned = 0;
+	for (unsigned i = 0; i < count; i++) {
+		intern(keys[i]);
+		_KV *current = _get(keys[i], strlen(keys[i]));
+		if (current == NULL)
+			return; // out of memory
+		++_pinned;
+	}
+}
+
+const char* MppJson::getSlot(unsigned slot) {
+	return slot < _pinned && !(_entries[slot].flags & KV_ABSENT) ?
+			_entries[slot].value : NULL;
+}
+
+void MppJson::putSlot(unsigned slot, const char *value) {
+	if (slot >= _pinned)
+		return;
+	unsigned length = value == NULL ? 0 : strlen(value);
+	if (value != NULL && _owns(value)) {
+		// the arena may move, use a copy
+		char copy[length + 1];
+		memcpy(copy, value, length + 1);
+		return putSlot(slot, copy);
+	}
+	_set(&_entries[slot], value, length, true);
+}
+
+void MppJson::removeSlot(unsigned slot) {
+	if (slot < _pinned)
+		_remove(&_entries[slot]);
 }
 
 const char* MppJson::get(const char *key) {
@@ -136,7 +789,8 @@ const char* MppJson::get(const char *key) {
 }
 
 bool MppJson::contains(const char *key) {
-	return _find(key) != NULL;
+	_KV *current = _find(key);
+	return current != NULL && !(current->flags & KV_ABSENT);
 }
 
 bool MppJson::has(const char *key) {
@@ -145,26 +799,37 @@ bool MppJson::has(const char *key) {
 			&& strlen(current->value) > 0;
 }
 
-bool _toBool(const char *value) {
-	if (value == NULL)
-		return false;
-	String test(value);
-	test.toLowerCase();
-	if (test == "true")
-		return true;
-	else if (test == "false")
-		return false;
-	else
-		return test.toInt();
-}
-
+// the typed getters use the cached number, parsing only plain strings
+// (with the previous String::toInt/toFloat semantics)
 bool MppJson::is(const char *key) {
-	return has(key) && _toBool(get(key));
+	_KV *current = _find(key);
+	if (current == NULL || current->value == NULL || *current->value == 0)
+		return false;
+	switch (current->type) {
+	case KV_BOOL:
+	case KV_INT:
+		return current->number.i != 0;
+	case KV_FLOAT:
+		return (int) current->number.f != 0;
+	default:
+		return atol(current->value) != 0;
+	}
 }
 
 int MppJson::getInt(const char *key) {
-	const char *value = get(key);
-	return value == NULL ? 0 : String(value).toInt();
+	_KV *current = _find(key);
+	if (current == NULL)
+		return 0;
+	switch (current->type) {
+	case KV_INT:
+		return current->number.i;
+	case KV_FLOAT:
+		return (int) current->number.f;
+	case KV_STRING:
+		return atol(current->value);
+	default:
+		return 0;
+	}
 }
 
 unsigned MppJson::getUnsigned(const char *key) {
@@ -172,40 +837,492 @@ unsigned MppJson::getUnsigned(const char *key) {
 }
 
 float MppJson::getFloat(const char *key) {
-	const char *value = get(key);
-	return value == NULL ? 0 : String(value).toFloat();
+	_KV *current = _find(key);
+	if (current == NULL)
+		return 0;
+	switch (current->type) {
+	case KV_INT:
+		return current->number.i;
+	case KV_FLOAT:
+		return current->number.f;
+	case KV_STRING:
+		return atof(current->value);
+	default:
+		return 0;
+	}
 }
 
+// keeps the arena (and pinned keys) for reuse
 void MppJson::clear() {
- // Serial.printf("Json clear! :%s key:%s\n",_properties,_properties->key);
-	while (_properties != NULL)
-		remove(_properties->key);
+	if (_index != NULL)
+		memset(_index, 0, _indexSize * sizeof(uint16_t));
+	_used = 0;
+	_size = 0;
+	_textUsed = 0;
+	_textLive = 0;
+	_compacted = ++_sequence;
+	if (_pinned > 0)
+		pin(_pinnedKeys, _pinned);
+}
+
+const _KV* MppJson::getNext(const _KV *current) {
+	const _KV *next = current == NULL ? _entries : current + 1;
+	for (; next != NULL && next < _entries + _used; next++)
+		if (!(next->flags & KV_ABSENT))
+			return next;
+	return NULL;
+}
+
+// output for the serializer, counts and optionally writes to a Print
+// (in chunks), a buffer or a String
+struct _Sink {
+	Print *print = NULL;
+	char *buffer = NULL;
+	unsigned size = 0;
+	String *string = NULL;
+	unsigned length = 0;
+	char chunk[64];
+	unsigned chunked = 0;
+	size_t written = 0;
+
+	void write(const char *text, unsigned n) {
+		if (buffer != NULL && length < size) {
+			unsigned room = size - length;
+			memcpy(buffer + length, text, n < room ? n : room);
+		} else if (string != NULL)
+			string->concat(text, n);
+		else if (print != NULL) {
+			for (unsigned i = 0; i < n; i++) {
+				if (chunked == sizeof(chunk))
+					flush();
+				chunk[chunked++] = text[i];
+			}
+		}
+		length += n;
+	}
+
+	void flush() {
+		if (print != NULL && chunked > 0)
+			written += print->write((const uint8_t*) chunk, chunked);
+		chunked = 0;
+	}
+};
+
+static void _writeString(_Sink &sink, const char *text) {
+	sink.write("\"", 1);
+	const char *run = text;
+	for (; *text; text++) {
+		const char *escape = NULL;
+		char hex[7];
+		switch (*text) {
+		case '"':
+			escape = "\\\"";
+			break;
+		case '\\':
+			escape = "\\\\";
+			break;
+		case '\n':
+			escape = "\\n";
+			break;
+		case '\r':
+			escape = "\\r";
+			break;
+		case '\t':
+			escape = "\\t";
+			break;
+		default:
+			if ((uint8_t) *text < 0x20) {
+				snprintf(hex, sizeof(hex), "\\u%04x", *text);
+				escape = hex;
+			}
+		}
+		if (escape != NULL) {
+			sink.write(run, text - run);
+			sink.write(escape, strlen(escape));
+			run = text + 1;
+		}
+	}
+	sink.write(run, text - run);
+	sink.write("\"", 1);
+}
+
+static void _writeEntry(_Sink &sink, const _KV *current, bool first) {
+	if (!first)
+		sink.write(",", 1);
+	_writeString(sink, current->key);
+	sink.write(":", 1);
+	if (current->value == NULL)
+		sink.write("null", 4);
+	else if (current->flags & KV_QUOTED)
+		_writeString(sink, current->value);
+	else // numbers and booleans as is
+		sink.write(current->value, strlen(current->value));
+}
+
+void MppJson::_serialize(_Sink &sink, MppFormat format) {
+	if (format == MPP_CBOR)
+		return _serializeCbor(sink);
+	sink.write("{", 1);
+	bool first = true;
+	for (const _KV *current = getFirst(); current != NULL;
+			current = getNext(current)) {
+		_writeEntry(sink, current, first);
+		first = false;
+	}
+	sink.write("}", 1);
+	sink.flush();
+}
+
+void MppJson::_serializeMasked(_Sink &sink, const MppRedact redact[],
+		unsigned count) {
+	sink.write("{", 1);
+	bool first = true;
+	for (const _KV *current = getFirst(); current != NULL;
+			current = getNext(current)) {
+		MppRedaction redaction = MPP_SHOW;
+		for (unsigned i = 0; i < count; i++)
+			if (redact[i].key == current->key
+					|| strcmp(redact[i].key, current->key) == 0)
+				redaction = redact[i].redaction;
+		bool empty = current->value == NULL || *current->value == 0;
+		if (redaction == MPP_MASK_OR_OMIT && empty)
+			continue;
+		if (!first)
+			sink.write(",", 1);
+		first = false;
+		_writeString(sink, current->key);
+		sink.write(":", 1);
+		if (redaction != MPP_SHOW && !empty)
+			sink.write("\"********\"", 10);
+		else if (current->value == NULL)
+			sink.write("null", 4);
+		else
+			_writeString(sink, current->value);
+	}
+	sink.write("}", 1);
+	sink.flush();
+}
+
+void MppJson::_serializeDelta(_Sink &sink, uint32_t since) {
+	bool full = !isDeltaComplete(since);
+	char head[32];
+	sink.write(head,
+			snprintf(head, sizeof(head), "{\"seq\":%lu,",
+					(unsigned long) _sequence));
+	if (full)
+		sink.write("\"full\":true,", 12);
+	sink.write("\"changes\":{", 11);
+	bool first = true;
+	for (unsigned i = 0; i < _used; i++) {
+		const _KV *current = &_entries[i];
+		if (full ? (current->flags & KV_ABSENT) : current->changed <= since)
+			continue;
+		_writeEntry(sink, current, first); // removed as null
+		first = false;
+	}
+	sink.write("}}", 2);
+	sink.flush();
+}
+
+unsigned MppJson::length(MppFormat format) {
+	_Sink sink;
+	_serialize(sink, format);
+	return sink.length;
+}
+
+size_t MppJson::printTo(Print &out, MppFormat format) {
+	_Sink sink;
+	sink.print = &out;
+	_serialize(sink, format);
+	return sink.written;
+}
+
+unsigned MppJson::toBuffer(char *buffer, unsigned size, MppFormat format) {
+	_Sink sink;
+	sink.buffer = buffer;
+	sink.size = size;
+	_serialize(sink, format);
+	if (size > 0)
+		buffer[sink.length < size ? sink.length : size - 1] = 0;
+	return sink.length;
 }
 
 String MppJson::toString() {
-	String result = "{";
-	_KV *current = _properties;
-	while (current != NULL) {
-		if (result.length() > 1)
-			result += ",";
-		result += "\"" + String(current->key) + "\":";
-		result +=
-				current->value == NULL ?
-						"null" : "\"" + String(current->value) + "\"";
-		current = current->next;
-	}
-	result += "}";
+	String result;
+	result.reserve(length());
+	_Sink sink;
+	sink.string = &result;
+	_serialize(sink);
+	return result;
+}
+
+unsigned MppJson::length(const MppRedact redact[], unsigned count) {
+	_Sink sink;
+	_serializeMasked(sink, redact, count);
+	return sink.length;
+}
+
+size_t MppJson::printTo(Print &out, const MppRedact redact[], unsigned count) {
+	_Sink sink;
+	sink.print = &out;
+	_serializeMasked(sink, redact, count);
+	return sink.written;
+}
+
+String MppJson::toString(const MppRedact redact[], unsigned count) {
+	String result;
+	result.reserve(length(redact, count));
+	_Sink sink;
+	sink.string = &result;
+	_serializeMasked(sink, redact, count);
+	return result;
+}
+
+const _KV* MppJson::getNextChange(const _KV *current, uint32_t since) {
+	const _KV *next = current == NULL ? _entries : current + 1;
+	for (; next != NULL && next < _entries + _used; next++)
+		if (next->changed > since)
+			return next;
+	return NULL;
+}
+
+unsigned MppJson::deltaLength(uint32_t since) {
+	_Sink sink;
+	_serializeDelta(sink, since);
+	return sink.length;
+}
+
+size_t MppJson::printDelta(Print &out, uint32_t since) {
+	_Sink sink;
+	sink.print = &out;
+	_serializeDelta(sink, since);
+	return sink.written;
+}
+
+String MppJson::deltaToString(uint32_t since) {
+	String result;
+	result.reserve(deltaLength(since));
+	_Sink sink;
+	sink.string = &result;
+	_serializeDelta(sink, since);
 	return result;
 }
 
 int MppJson::size() {
-	int result = 0;
-	_KV *current = _properties;
-	while (current != NULL) {
-		++result;
-		current = current->next;
+	return _size;
+}
+
+/*
+ * CBOR (RFC 8949) form of the flat object, a map of text keys.  Quoted
+ * values are text strings, bare numbers and booleans keep their binary
+ * form so they need no formatting or parsing on the other side.
+ */
+#define CBOR_UINT 0
+#define CBOR_NINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7 // and floats
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+#define CBOR_UNDEFINED 23
+
+// major type and argument in the shortest form, returns the length
+static unsigned _cborHead(char *head, uint8_t major, uint32_t argument) {
+	major <<= 5;
+	if (argument < 24) {
+		head[0] = major | argument;
+		return 1;
+	} else if (argument <= 0xFF) {
+		head[0] = major | 24;
+		head[1] = argument;
+		return 2;
+	} else if (argument <= 0xFFFF) {
+		head[0] = major | 25;
+		head[1] = argument >> 8;
+		head[2] = argument;
+		return 3;
 	}
-	return result;
+	head[0] = major | 26;
+	for (unsigned i = 4; i > 0; i--, argument >>= 8)
+		head[i] = argument;
+	return 5;
+}
+
+static void _writeCborText(_Sink &sink, const char *text) {
+	char head[5];
+	unsigned length = strlen(text);
+	sink.write(head, _cborHead(head, CBOR_TEXT, length));
+	sink.write(text, length);
+}
+
+unsigned MppJson::cborArray(char *buffer, unsigned count) {
+	return _cborHead(buffer, CBOR_ARRAY, count);
+}
+
+void MppJson::_serializeCbor(_Sink &sink) {
+	char head[5];
+	sink.write(head, _cborHead(head, CBOR_MAP, _size));
+	for (const _KV *current = getFirst(); current != NULL;
+			current = getNext(current)) {
+		_writeCborText(sink, current->key);
+		if (current->value == NULL) {
+			head[0] = CBOR_SIMPLE << 5 | CBOR_NULL;
+			sink.write(head, 1);
+		} else if (current->flags & KV_QUOTED || current->type == KV_STRING)
+			_writeCborText(sink, current->value);
+		else if (current->type == KV_BOOL) {
+			head[0] = CBOR_SIMPLE << 5
+					| (current->number.i ? CBOR_TRUE : CBOR_FALSE);
+			sink.write(head, 1);
+		} else if (current->type == KV_INT) {
+			int32_t number = current->number.i;
+			sink.write(head,
+					number < 0 ?
+							_cborHead(head, CBOR_NINT, -1 - number) :
+							_cborHead(head, CBOR_UINT, number));
+		} else { // single precision float
+			uint32_t bits;
+			memcpy(&bits, &current->number.f, sizeof(bits));
+			head[0] = CBOR_SIMPLE << 5 | 26;
+			for (unsigned i = 4; i > 0; i--, bits >>= 8)
+				head[i] = bits;
+			sink.write(head, 5);
+		}
+	}
+	sink.flush();
+}
+
+// reads the head at i, false if truncated or indefinite
+static bool _cborRead(const uint8_t *in, unsigned length, unsigned &i,
+		uint8_t &major, uint8_t &info, uint64_t &argument) {
+	if (i >= length)
+		return false;
+	major = in[i] >> 5;
+	info = in[i++] & 0x1F;
+	if (info < 24) {
+		argument = info;
+		return true;
+	} else if (info > 27)
+		return false;
+	unsigned n = 1 << (info - 24);
+	if (length - i < n)
+		return false;
+	argument = 0;
+	while (n--)
+		argument = argument << 8 | in[i++];
+	return true;
+}
+
+static float _cborHalf(uint16_t half) {
+	int exponent = (half >> 10) & 0x1F;
+	int mantissa = half & 0x3FF;
+	float value =
+			exponent == 0 ? ldexpf(mantissa, -24) :
+			exponent == 31 ? (mantissa ? NAN : INFINITY) :
+			ldexpf(mantissa + 1024, exponent - 25);
+	return half & 0x8000 ? -value : value;
+}
+
+const char* MppJson::_loadCbor(const char *cbor, unsigned length,
+		unsigned *errorOffset) {
+	const uint8_t *in = (const uint8_t*) cbor;
+	const char *error = nullptr;
+	unsigned i = 0, item = 0;
+	uint8_t major, info;
+	uint64_t count = 0, argument;
+	clear();
+	if (!_cborRead(in, length, i, major, info, count) || major != CBOR_MAP)
+		error = "Expected CBOR map";
+	for (; error == nullptr && count > 0; count--) {
+		item = i;
+		if (!_cborRead(in, length, i, major, info, argument)
+				|| major != CBOR_TEXT || argument > length - i) {
+			error = "Expected key";
+			break;
+		}
+		const char *key = cbor + i;
+		unsigned keyLength = argument;
+		if (keyLength > MPP_KEY_MAX) {
+			error = "Key too long";
+			break;
+		}
+		i += keyLength;
+		item = i;
+		if (!_cborRead(in, length, i, major, info, argument)) {
+			error = "Expected value";
+			break;
+		}
+		char number[32];
+		const char *value = number;
+		unsigned valueLength = 0;
+		bool quoted = false;
+		double real;
+		switch (major) {
+		case CBOR_UINT:
+			valueLength = snprintf(number, sizeof(number), "%llu",
+					(unsigned long long) argument);
+			break;
+		case CBOR_NINT:
+			valueLength = snprintf(number, sizeof(number), "-%llu",
+					(unsigned long long) argument + 1);
+			break;
+		case CBOR_TEXT:
+			if (argument > length - i) {
+				error = "Unterminated string";
+				break;
+			}
+			value = cbor + i;
+			valueLength = argument;
+			quoted = true;
+			i += valueLength;
+			break;
+		case CBOR_ARRAY:
+		case CBOR_MAP:
+			error = "Nested values not supported";
+			break;
+		case CBOR_SIMPLE:
+			if (info == CBOR_FALSE || info == CBOR_TRUE) {
+				value = info == CBOR_TRUE ? "true" : "false";
+				valueLength = strlen(value);
+			} else if (info == CBOR_NULL || info == CBOR_UNDEFINED)
+				value = NULL;
+			else if (info >= 25 && info <= 27) {
+				if (info == 25)
+					real = _cborHalf(argument);
+				else if (info == 26) {
+					uint32_t bits = argument;
+					float single;
+					memcpy(&single, &bits, sizeof(single));
+					real = single;
+				} else
+					memcpy(&real, &argument, sizeof(real));
+				if (isfinite(real))
+					valueLength = snprintf(number, sizeof(number),
+							info == 27 ? "%.15g" : "%.7g", real);
+				else
+					value = NULL; // not representable in json
+			} else
+				error = "Unsupported CBOR value";
+			break;
+		default:
+			error = "Unsupported CBOR value";
+		}
+		if (error == nullptr
+				&& !_put(key, keyLength, false, value, valueLength, false,
+						quoted))
+			error = "Out of memory";
+	}
+	if (error == nullptr && i != length) {
+		item = i;
+		error = "Unexpected data after map";
+	}
+	if (errorOffset != NULL)
+		*errorOffset = error == nullptr ? 0 : item;
+	return error;
 }
 
 MppJsonArray::MppJsonArray() {
@@ -215,35 +1332,180 @@ MppJsonArray::~MppJsonArray() {
 }
 
 const char* MppJsonArray::loadFrom(String newJsonString) {
-	if (newJsonString.length() < 2)
-		return "Invalid length";
-	else if (newJsonString.charAt(0) != '['
-			|| newJsonString.charAt(newJsonString.length() - 1) != ']')
-		return "Missing json array delimiters";
-	else {
-		current = 0;
-		jsonString = newJsonString;
-		return nullptr;
+	jsonString = newJsonString;
+	return loadFrom(jsonString.c_str(), jsonString.length());
+}
+
+const char* MppJsonArray::loadFrom(const char *json, unsigned length) {
+	_reset();
+	if (json == NULL || length < 2) {
+		_fail("Invalid length");
+		return _error;
+	}
+	_json = json;
+	_length = length;
+	return _open();
+}
+
+const char* MppJsonArray::loadFrom(Stream &stream, char *buffer,
+		unsigned size) {
+	_reset();
+	if (buffer == NULL || size < 2) {
+		_fail("Invalid buffer");
+		return _error;
+	}
+	_stream = &stream;
+	_buffer = buffer;
+	_size = size;
+	return _open();
+}
+
+void MppJsonArray::_reset() {
+	_json = NULL;
+	_length = 0;
+	_position = 0;
+	_stream = NULL;
+	_buffer = NULL;
+	_size = 0;
+	_pushed = -1;
+	_started = false;
+	_pending = false;
+	_done = false;
+	_error = NULL;
+	_element = NULL;
+	_elementLength = 0;
+}
+
+const char* MppJsonArray::_open() {
+	if (_skipSpace() != '[')
+		_fail("Missing json array delimiters");
+	return _error;
+}
+
+int MppJsonArray::_read() {
+	if (_pushed >= 0) {
+		int c = _pushed;
+		_pushed = -1;
+		return c;
 	}
+	if (_stream != NULL) {
+		char c;
+		return _stream->readBytes(&c, 1) == 1 ? (unsigned char) c : -1;
+	}
+	return _position < _length ? (unsigned char) _json[_position++] : -1;
+}
+
+int MppJsonArray::_skipSpace() {
+	int c;
+	do
+		c = _read();
+	while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+	return c;
+}
+
+// a borrowed json is not copied, the element is just extended
+bool MppJsonArray::_append(int c) {
+	if (_stream == NULL) {
+		++_elementLength;
+		return true;
+	}
+	if (_elementLength + 1 >= _size)
+		return false;
+	_buffer[_elementLength++] = (char) c;
+	_buffer[_elementLength] = 0;
+	return true;
+}
+
+bool MppJsonArray::_fail(const char *error) {
+	_error = error;
+	_done = true;
+	return false;
+}
+
+// finds the next element, tracking the depth and strings
+bool MppJsonArray::_scan() {
+	if (_done)
+		return false;
+	int c = _skipSpace();
+	if (c == ']' && !_started) { // empty array
+		_done = true;
+		return false;
+	}
+	if (_started) {
+		if (c == ']') {
+			_done = true;
+			return false;
+		} else if (c != ',')
+			return _fail(c < 0 ? "Unterminated array" : "Expected ',' or ']'");
+		c = _skipSpace();
+	}
+	if (c < 0)
+		return _fail("Unterminated array");
+	if (c == ',' || c == ']' || c == '}')
+		return _fail("Expected value");
+	_started = true;
+	_element = _stream == NULL ? _json + _position - 1 : _buffer;
+	_elementLength = 0;
+	unsigned depth = 0;
+	bool inString = false;
+	bool escaped = false;
+	for (;;) {
+		if (!_append(c))
+			return _fail("Element too large");
+		if (inString) {
+			if (escaped)
+				escaped = false;
+			else if (c == '\\')
+				escaped = true;
+			else if (c == '"') {
+				inString = false;
+				if (depth == 0)
+					break;
+			}
+		} else if (c == '"')
+			inString = true;
+		else if (c == '{' || c == '[')
+			++depth;
+		else if (c == '}' || c == ']') {
+			if (--depth == 0)
+				break;
+		} else if (depth == 0) {
+			// a literal, ends before the next delimiter
+			c = _read();
+			if (c < 0 || c == ',' || c == ']' || c == ' ' || c == '\t'
+					|| c == '\r' || c == '\n') {
+				_pushed = c;
+				break;
+			}
+			continue;
+		}
+		c = _read();
+		if (c < 0)
+			return _fail("Unterminated element");
+	}
+	return true;
 }
 
 bool MppJsonArray::hasNext() {
-	if (current >= jsonString.length())
+	if (!_pending)
+		_pending = _scan();
+	return _pending;
+}
+
+bool MppJsonArray::next(const char *&element, unsigned &length) {
+	if (!hasNext())
 		return false;
-	int i = jsonString.indexOf('{',current);
-	return !(i == -1 || jsonString.indexOf('}', i) == -1);
+	_pending = false;
+	element = _element;
+	length = _elementLength;
+	return true;
 }
 
 String MppJsonArray::next() {
-	int i = jsonString.indexOf('{', current);
 	String result = ""; // default
-	current = jsonString.length(); // no next
-	if (i != -1) {
-		int j = jsonString.indexOf('}', i);
-		if (j != -1) {
-			current = j + 2;
-			result = jsonString.substring(i, j + 1);
-		}
-	}
+	const char *element;
+	unsigned length;
+	if (next(element, length))
+		result.concat(element, length);
 	return result;
 }
@@ -15,22 +15,76 @@ For devices managed by AutomationManager (AM)
 #define MPP_JSON_H_
 
 #define MAX_PROPERTIES 30
+#define MPP_KEY_MAX 64 // longer keys are rejected by the parsers
 
+struct _Sink;
+
+#define KV_ABSENT 0x01 // removed, or a pinned entry without a value
+#define KV_QUOTED 0x02 // serialized as a json string
+#define KV_INLINE 0x04 // value is held in the entry
+#define KV_OWN_KEY 0x08 // key text is in the arena, not interned
+#define KV_INLINE_SIZE 8 // "on", "false", short numbers (with the terminator)
+
+// value types, decided when the value is put or parsed
+enum KVType {
+	KV_NULL, KV_STRING, KV_INT, KV_FLOAT, KV_BOOL
+};
+
+// a key/value entry, the key is interned (or in the arena for sets that
+// don't intern), the value text lives in the arena of the owning MppJson
 struct _KV {
-	char* key;
-	char* value;
-	_KV* next;
+	const char* key;
+	char* value; // NULL for a json null, may point to small
+	uint32_t hash; // of the key
+	uint16_t capacity; // bytes reserved for the value (in place updates)
+	uint8_t flags;
+	uint8_t type; // KVType
+	union {
+		int32_t i; // KV_INT, KV_BOOL
+		float f; // KV_FLOAT
+	} number; // cached from the value text
+	uint32_t changed; // sequence of the last change
+	char small[KV_INLINE_SIZE]; // short values, no arena text needed
+};
+
+// serialized forms, per call, json text is the default
+enum MppFormat { MPP_JSON, MPP_CBOR };
+
+// how a value is shown by the masking serializer
+enum MppRedaction {
+	MPP_SHOW, // as is
+	MPP_MASK, // "********" unless empty or null
+	MPP_MASK_OR_OMIT // "********", left out if empty or null
+};
+
+struct MppRedact {
+	const char* key;
+	MppRedaction redaction;
 };
 
 // simple flat (k/v string pairs) json object
+// entries, the hash index and all value text share one arena allocation,
+// keys are interned process wide for long lived sets (internKeys)
 class MppJson {
 public:
 	MppJson();
 	~MppJson();
+	MppJson(const MppJson&) = delete;
+	MppJson& operator=(const MppJson&) = delete;
 	// returns nullptr if ok, error message if failure
 	const char* loadFrom(const String jsonString);
+	// errorOffset (optional) is set to the position of the failure
+	const char* loadFrom(const char* data, unsigned length,
+			unsigned* errorOffset = NULL, MppFormat format = MPP_JSON);
 	void clear();
-	void put(const char* key, const char* value);
+	void put(const char* key, const char* value); // json string (or null)
+	// typed values, serialized as json numbers/booleans
+	void putInt(const char* key, int value);
+	void putFloat(const char* key, float value, unsigned decimals = 2);
+	void putBool(const char* key, bool value);
+	// stored value text, a json string if quoted, else a bare literal (as
+	// a string if it is not a valid one)
+	void putText(const char* key, const char* value, bool quoted);
 	void remove(const char* key);
 	bool contains(const char* key); // if property is in the set
 	bool has(const char* key); // if property has a value
@@ -43,26 +97,139 @@ public:
 	unsigned getUnsigned(const char* key);
 	float getFloat(const char* key);
 	String toString();
-	const _KV* getFirst() { return _properties; }
+	// exact length of toString(), without allocating
+	unsigned length(MppFormat format = MPP_JSON);
+	// serialize without building a String, returns the bytes written
+	size_t printTo(Print& out, MppFormat format = MPP_JSON);
+	// writes at most size - 1 bytes and a terminator, returns the full length
+	unsigned toBuffer(char* buffer, unsigned size, MppFormat format = MPP_JSON);
+	// display form in one pass, every value as a json string and the
+	// values of the listed keys masked, without copying the set
+	unsigned length(const MppRedact redact[], unsigned count);
+	size_t printTo(Print& out, const MppRedact redact[], unsigned count);
+	String toString(const MppRedact redact[], unsigned count);
+	// cbor array head for count items (at most 5 bytes), returns its length
+	static unsigned cborArray(char* buffer, unsigned count);
+	// pin keys to the first entries for indexed slot access, call when empty
+	void pin(const char* const keys[], unsigned count);
+	const char* getSlot(unsigned slot); // NULL if not in the set
+	void putSlot(unsigned slot, const char* value);
+	void removeSlot(unsigned slot);
+	// register a key with static storage so it is shared rather than copied
+	// (e.g. property name constants), returns the interned key
+	static const char* intern(const char* key);
+	// long lived sets (properties, device attributes) add their new keys to
+	// the process wide table, the others only share keys already in it and
+	// copy the rest into their arena, so parsing requests doesn't grow it
+	void internKeys(bool intern) { _internKeys = intern; }
+	static unsigned internedKeys(); // number of distinct keys
+	static unsigned heapAllocations(); // by all MppJson objects and the key table
+	// change tracking, every change gets the next sequence number so
+	// getSequence() is a snapshot to serialize the changes after.  The
+	// sequence restarts after a reboot, a sequence ahead of it is from before
+	// and counts as changed
+	uint32_t getSequence() { return _sequence; }
+	bool changedSince(uint32_t sequence) { return _sequence != sequence; }
+	// {"seq":n,"changes":{...}} with removed keys as null, or with
+	// "full":true and every key if the delta is not complete
+	unsigned deltaLength(uint32_t since);
+	size_t printDelta(Print& out, uint32_t since);
+	String deltaToString(uint32_t since);
+	// iterate the entries changed after since, removed ones included
+	// (KV_ABSENT), e.g. to persist only those
+	const _KV* getNextChange(const _KV* current, uint32_t since);
+	// false if removals since were compacted away, or since is from before
+	// a reboot, iterating the changes then misses them
+	bool isDeltaComplete(uint32_t since) {
+		return since >= _compacted && since <= _sequence;
+	}
+	// iterate the entries, NULL when done
+	const _KV* getFirst() { return getNext(NULL); }
+	const _KV* getNext(const _KV* current);
 	int size(); // number of key/value pairs
 private:
-	_KV* _properties = NULL;
-	_KV* _get(const char* key); // create if not found
+	char* _arena = NULL; // [entries][hash index][value text]
+	_KV* _entries = NULL;
+	uint16_t* _index = NULL; // open addressed, entry + 1, 0 empty
+	char* _text = NULL;
+	uint16_t _capacity = 0; // entries
+	uint16_t _indexSize = 0; // power of 2
+	uint16_t _used = 0; // entries in use, including removed
+	uint16_t _size = 0; // live entries
+	unsigned _textSize = 0;
+	unsigned _textUsed = 0;
+	unsigned _textLive = 0; // bytes still referenced
+	const char* const* _pinnedKeys = NULL;
+	uint16_t _pinned = 0; // entries 0.._pinned-1 are never compacted away
+	uint32_t _sequence = 0;
+	uint32_t _compacted = 0; // sequence when removed entries were last dropped
+	bool _internKeys = false;
+	_KV* _get(const char* key, unsigned length); // create if not found
 	_KV* _find(const char* key);
+	_KV* _find(const char* key, unsigned length, uint32_t hash, unsigned* slot);
+	_KV* _set(_KV* current, const char* value, unsigned length, bool quoted);
+	void _classify(_KV* current);
+	void _put(const char* key, const char* value, bool quoted);
+	bool _put(const char* key, unsigned keyLength, bool keyEscaped,
+			const char* value, unsigned length, bool escaped, bool quoted);
+	void _remove(_KV* current);
+	void _release(_KV* current);
+	bool _dropped(unsigned entry); // removed, not kept by a rebuild
+	void _serialize(_Sink& sink, MppFormat format = MPP_JSON);
+	void _serializeCbor(_Sink& sink);
+	void _serializeMasked(_Sink& sink, const MppRedact redact[], unsigned count);
+	const char* _loadJson(const char* json, unsigned length, unsigned* errorOffset);
+	const char* _loadCbor(const char* cbor, unsigned length, unsigned* errorOffset);
+	void _serializeDelta(_Sink& sink, uint32_t since);
+	char* _alloc(unsigned length); // from the arena text, NULL if full
+	bool _owns(const char* text); // text is in the arena
+	// regrow/compact the arena with room for additional entries and text,
+	// track is updated to the moved entry
+	bool _rebuild(unsigned entries, unsigned text, _KV** track);
 };
 
-// simple json array of Strings of MppJson objects
+// cursor over the elements of a json array, elements are handed back as
+// views (pointer + length) that MppJson::loadFrom can parse in place.
+// Nested objects/arrays and strings are tracked so a '}' or ',' inside an
+// element does not end it.
 class MppJsonArray {
 public:
 	MppJsonArray();
 	// returns nullptr if ok, error message if failure
-	const char* loadFrom(const String jsonString);
+	const char* loadFrom(const String jsonString); // keeps a copy
+	// borrows the json, it must stay valid while iterating
+	const char* loadFrom(const char* json, unsigned length);
+	// reads one element at a time from the stream into the buffer, so the
+	// array can be any size as long as each element fits in the buffer
+	const char* loadFrom(Stream& stream, char* buffer, unsigned size);
 	~MppJsonArray();
 	bool hasNext();
 	String next(); // get the next string in a json array, empty if none
+	// view of the next element (not terminated in a borrowed json), false if none
+	bool next(const char*& element, unsigned& length);
+	const char* getError() { return _error; } // nullptr unless malformed
 private:
-	unsigned int current = 0;
 	String jsonString;
+	const char* _json = NULL;
+	unsigned _length = 0;
+	unsigned _position = 0;
+	Stream* _stream = NULL;
+	char* _buffer = NULL;
+	unsigned _size = 0;
+	int _pushed = -1; // character read ahead, -1 if none
+	bool _started = false; // past the first element
+	bool _pending = false; // an element was scanned by hasNext()
+	bool _done = true;
+	const char* _error = NULL;
+	const char* _element = NULL;
+	unsigned _elementLength = 0;
+	void _reset();
+	const char* _open();
+	int _read();
+	int _skipSpace();
+	bool _append(int c);
+	bool _fail(const char* error);
+	bool _scan();
 };
 
 #endif /* MPP_JSON_H_ */
@@ -1,8 +1,9 @@
+#include "config.h"
 #include "Mpp32Properties.h"
+#include "Mpp32Journal.h"
 #include <stdlib.h>
-#include <EEPROM.h>
-#include <nvs.h> 
 #include <nvs_flash.h>
+#include <esp_system.h>
 
 /*
  * Properties ESP32.cpp
@@ -13,37 +14,34 @@ For devices managed by AutomationManager (AM)
  *
  */
 
-#define MaxProps 1024
-#define MppMarkerLength 14
-#define MppPropertiesLength MaxProps - MppMarkerLength
-static const char MppMarker[MppMarkerLength] = "MppProperties";
-
 const char *P_PASSWORD = "Password";
 const char *P_GATEWAY_PW = "GatewayPassword";
 
-static bool writeProperties(String target) {
-// Serial.print("writeProperty 1: "+target);
-	if (target.length() < MppPropertiesLength) {
-		for (unsigned i = 0; i < MppPropertiesLength && i < target.length() + 1;
-				i++)
-//        EEPROM.writeChar(i + MppMarkerLength, target.charAt(i));
-			EEPROM.put(i + MppMarkerLength, target.charAt(i));
-// Serial.printf("Properties heap=%d \n", ESP.getFreeHeap());
-		EEPROM.commit();
-		return true;
-	} else {
-		Serial.println("Properties do not fit in reserved EEPROM space.");
-		return false;
-	}
+// constant initialized, so usable from the constructors of other statics
+// (a global MppServer begins its properties during static initialization)
+static MppNvsStore nvsStore; // the default
+#if !defined(MPP_PROPERTIES_JOURNAL) && defined(MPP_PROPERTIES_PAGED)
+static MppPagedStore pagedStore;
+#endif
+static MppProperties *writeBehind = NULL; // flushed when restarting
+
+static void flushOnRestart() {
+	if (writeBehind != NULL)
+		writeBehind->flush();
 }
 
 MppProperties::MppProperties() {
+	properties.internKeys(true); // lives as long as the device
+	setRedaction(P_PASSWORD, MPP_MASK_OR_OMIT);
+	setRedaction(P_GATEWAY_PW, MPP_MASK);
 }
 
-static char propertiesString[MppPropertiesLength];
+void MppProperties::setStore(MppPropertyStore *store) {
+	this->store = store;
+}
 
 void MppProperties::begin() {
-  
+	unsigned long started = millis();
   esp_err_t err = nvs_flash_init();   // Initialize NVS 
   if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) 
     { ESP_ERROR_CHECK(nvs_flash_erase()); 
@@ -51,74 +49,195 @@ void MppProperties::begin() {
     } 
       ESP_ERROR_CHECK(err);
   
-	if(!EEPROM.begin(MaxProps)) { Serial.println("Error Initializing 1024 bytes of EEPROM !"); return; }
-	for (int i = 0; i < MppMarkerLength; i++) {
-		if (MppMarker[i] != EEPROM.read(i)) {
-			Serial.print("EEPROM marker mismatch, found '");
-			for (int x = 0; x < MppMarkerLength; x++)
-				Serial.print(EEPROM.read(x));
-			Serial.print("'\n");
-			Serial.println("EEPROM initializing...");
-//     EEPROM.writeString(0, MppMarker);
-			EEPROM.put(0, MppMarker);
- //    EEPROM.commit(); /// for test
-    	properties.clear();
-			save();
-			Serial.println("EEPROM initialized");
-			break;
-		}
+	if (store == NULL) {
+#ifdef MPP_PROPERTIES_JOURNAL
+		// constructed on first use, not in static initialization order
+		static MppPartitionFlash journalFlash(MPP_PROPERTIES_JOURNAL);
+		static MppJournalStore journalStore(journalFlash);
+		store = &journalStore;
+#elif defined(MPP_PROPERTIES_PAGED)
+		store = &pagedStore;
+#else
+		store = &nvsStore;
+#endif
 	}
-	for (unsigned i = 0; i < MppPropertiesLength; i++) {
-		propertiesString[i] = EEPROM.read(i + MppMarkerLength);
-		if (propertiesString[i] == 0)
-			break;	
-			}
-// Serial.printf("Properties string:%s\n",propertiesString);
-	const char* error = properties.loadFrom(propertiesString);
-	if (error) {
-		Serial.printf("Properties.load failed: %s\n", error);
-		properties.clear();
-		save();
+	if (!store->load(properties)) {
+		// first start with this store, take over the properties of earlier
+		// versions from NVS or EEPROM (left there as they are)
+		MppEepromStore legacy;
+		if (store != &nvsStore && nvsStore.load(properties))
+			Serial.printf("Migrating %d properties from NVS\n",
+					properties.size());
+		else if (legacy.load(properties))
+			Serial.printf("Migrating %d properties from EEPROM\n",
+					properties.size());
+		else {
+			Serial.println("Properties initializing...");
+			properties.clear();
+		}
+		saved = 0; // all of them
+		write();
 	}
+	saved = properties.getSequence();
+	loadMillis = millis() - started;
+	Serial.printf("Properties loaded in %lums\n", loadMillis);
 }
 
 MppProperties::~MppProperties() {
+	free(schema);
+	while (observers != NULL) {
+		_Observer *next = observers->next;
+		delete observers;
+		observers = next;
+	}
 }
 
 void MppProperties::remove(const char *key) {
 	properties.remove(key);
+	notifyObservers();
 }
 
 void MppProperties::put(const char *k_ptr, const char *v_ptr) {
 	properties.put(k_ptr, v_ptr);
+	notifyObservers();
+}
+
+bool MppProperties::putValid(const char *key, const char *value) {
+	const char *invalid = validate(key, value);
+	if (invalid != nullptr) {
+		error = String(key) + " " + invalid;
+		Serial.printf("Property rejected, %s\n", error.c_str());
+		return false;
+	}
+	restartPending |= changesRestart(key, value);
+	const MppPropertySpec *spec = getSpec(key);
+	if (spec != NULL && spec->type != MPP_TEXT)
+		properties.putText(key, value, false);
+	else
+		properties.put(key, value);
+	notifyObservers();
+	return true;
+}
+
+void MppProperties::define(const MppPropertySpec &spec) {
+	MppPropertySpec *grown = (MppPropertySpec*) realloc(schema,
+			(schemaCount + 1) * sizeof(MppPropertySpec));
+	if (grown == NULL)
+		return;
+	schema = grown;
+	schema[schemaCount] = spec;
+	schema[schemaCount].name = MppJson::intern(spec.name);
+	++schemaCount;
+	const char *invalid =
+			properties.has(spec.name) ?
+					validate(spec.name, properties.get(spec.name)) : nullptr;
+	if (invalid != nullptr) {
+		// a stored value is not dropped, it becomes what the getters read
+		char converted[16];
+		if (spec.type == MPP_BOOL)
+			strcpy(converted, is(spec.name) ? "true" : "false");
+		else if (spec.type == MPP_FLOAT)
+			snprintf(converted, sizeof(converted), "%g", getFloat(spec.name));
+		else
+			snprintf(converted, sizeof(converted), "%d", getInt(spec.name));
+		if (validate(spec.name, converted) == nullptr) {
+			Serial.printf("Property %s %s, converted to %s\n", spec.name, invalid,
+					converted);
+			properties.putText(spec.name, converted, false);
+		} else
+			Serial.printf("Property %s %s, kept\n", spec.name, invalid);
+	}
+	notifyObservers();
+}
+
+// the default of a registered property without a value, NULL if none.
+// Defaults are served from the schema, not stored, so they cost no flash
+// and a removed property falls back to its default
+const char* MppProperties::defaultFor(const char *key) {
+	if (schemaCount == 0 || properties.has(key))
+		return NULL;
+	const MppPropertySpec *spec = getSpec(key);
+	return spec == NULL ? NULL : spec->defaultValue;
+}
+
+const MppPropertySpec* MppProperties::getSpec(const char *key) {
+	for (unsigned i = 0; i < schemaCount; i++)
+		if (schema[i].name == key || strcmp(schema[i].name, key) == 0)
+			return &schema[i];
+	return NULL;
+}
+
+const char* MppProperties::validate(const char *key, const char *value) {
+	const MppPropertySpec *spec = getSpec(key);
+	if (spec == NULL || value == NULL || spec->type == MPP_TEXT)
+		return nullptr; // anything, or removed (back to the default)
+	char *end;
+	if (spec->type == MPP_BOOL) // as is() reads it
+		return strcasecmp(value, "true") == 0 || strcasecmp(value, "false") == 0
+				|| (*value != 0 && (strtol(value, &end, 10), *end == 0)) ?
+				nullptr : "is not true or false";
+	float number;
+	if (spec->type == MPP_FLOAT)
+		number = strtof(value, &end);
+	else if (spec->type == MPP_INT)
+		number = strtol(value, &end, 10);
+	else if (*value == '-')
+		return "is negative";
+	else
+		number = strtoul(value, &end, 10);
+	if (*value == 0 || *end != 0)
+		return "is not a number";
+	if (spec->min < spec->max && (number < spec->min || number > spec->max))
+		return "is out of range";
+	return nullptr;
+}
+
+// the effective value (or default) of a restart property changes
+bool MppProperties::changesRestart(const char *key, const char *value) {
+	const MppPropertySpec *spec = getSpec(key);
+	if (spec == NULL || !spec->requiresRestart)
+		return false;
+	const char *current = has(key) ? get(key) : spec->defaultValue;
+	if (value == NULL)
+		value = spec->defaultValue;
+	return current == NULL || value == NULL ?
+			current != value : strcmp(current, value) != 0;
 }
 
 const char* MppProperties::get(const char *key) {
-	return properties.get(key);
+	const char *value = defaultFor(key);
+	return value != NULL ? value : properties.get(key);
 }
 
 bool MppProperties::contains(const char *key) {
-	return properties.contains(key);
+	return properties.contains(key) || defaultFor(key) != NULL;
 }
 
 bool MppProperties::has(const char *key) {
-	return properties.has(key);
+	return properties.has(key) || defaultFor(key) != NULL;
 }
 
+// set values are read from the cached number, defaults from their text
 bool MppProperties::is(const char *key) {
+	const char *value = defaultFor(key);
+	if (value != NULL)
+		return strcasecmp(value, "true") == 0 || atol(value) != 0;
 	return properties.is(key);
 }
 
 int MppProperties::getInt(const char *key) {
-	return properties.getInt(key);
+	const char *value = defaultFor(key);
+	return value != NULL ? atol(value) : properties.getInt(key);
 }
 
 unsigned MppProperties::getUnsigned(const char *key) {
-	return properties.getUnsigned(key);
+	const char *value = defaultFor(key);
+	return value != NULL ? strtoul(value, NULL, 10) : properties.getUnsigned(key);
 }
 
 float MppProperties::getFloat(const char *key) {
-	return properties.getFloat(key);
+	const char *value = defaultFor(key);
+	return value != NULL ? atof(value) : properties.getFloat(key);
 }
 
 bool MppProperties::update(const String &newProperties) {
@@ -126,49 +245,227 @@ bool MppProperties::update(const String &newProperties) {
 	const char *g_ptr = has(P_GATEWAY_PW) ? get(P_GATEWAY_PW) : NULL;
 	String password = p_ptr; // cache it
 	String gatewayPW = g_ptr;
-	const char* error = properties.loadFrom(newProperties);
-	if (error) {
-		Serial.printf("Properties.load failed: %s\n", error);
+	unsigned offset;
+	bool restart = false;
+	if (schemaCount > 0) {
+		// checked before anything is replaced
+		MppJson incoming;
+		const char *failed = incoming.loadFrom(newProperties.c_str(),
+				newProperties.length(), &offset);
+		if (failed != nullptr)
+			error = failed;
+		for (unsigned i = 0; failed == nullptr && i < schemaCount; i++) {
+			const char *key = schema[i].name;
+			const char *value = incoming.has(key) ? incoming.get(key) : NULL;
+			if ((failed = validate(key, value)) != nullptr)
+				error = String(key) + " " + failed;
+			else
+				restart |= changesRestart(key, value);
+		}
+		if (failed != nullptr) {
+			Serial.printf("Properties update rejected: %s\n", error.c_str());
+			return false;
+		}
+	}
+	const char* failed = properties.loadFrom(newProperties.c_str(),
+			newProperties.length(), &offset);
+	if (failed) {
+		error = failed;
+		Serial.printf("Properties.load failed: %s at %u\n", failed, offset);
 		return false;
 	} else {
+		restartPending |= restart;
+		for (unsigned i = 0; i < schemaCount; i++) {
+			// typed values as literals, e.g. "5" sent as a json string
+			if (schema[i].type != MPP_TEXT && properties.has(schema[i].name)) {
+				String value = properties.get(schema[i].name);
+				properties.putText(schema[i].name, value.c_str(), false);
+			}
+		}
 		if (p_ptr != NULL)
-			put(P_PASSWORD, password.c_str());
+			properties.put(P_PASSWORD, password.c_str());
 		const char *gwpw = get(P_GATEWAY_PW);
 		if (g_ptr != NULL
 				&& (gwpw == NULL || strlen(gwpw) == 0
 						|| strcmp("********", gwpw) == 0))
-			put(P_GATEWAY_PW, gatewayPW.c_str());
+			properties.put(P_GATEWAY_PW, gatewayPW.c_str());
+		notifyObservers();
 		save();
 		return true;
 	}
 }
 
+bool MppProperties::patch(const String &mergePatch, String *changes) {
+	MppJson incoming;
+	unsigned offset;
+	const char *failed = incoming.loadFrom(mergePatch.c_str(),
+			mergePatch.length(), &offset);
+	if (failed) {
+		error = failed;
+		Serial.printf("Properties.patch failed: %s at %u\n", failed, offset);
+		return false;
+	}
+	bool restart = false;
+	const _KV *current;
+	// checked before anything is changed
+	for (current = incoming.getFirst(); current != NULL;
+			current = incoming.getNext(current)) {
+		if ((failed = validate(current->key, current->value)) != nullptr) {
+			error = String(current->key) + " " + failed;
+			Serial.printf("Properties patch rejected: %s\n", error.c_str());
+			return false;
+		}
+		restart |= changesRestart(current->key, current->value);
+	}
+	MppJson changed;
+	for (current = incoming.getFirst(); current != NULL;
+			current = incoming.getNext(current)) {
+		const char *key = current->key;
+		if (current->value != NULL && strcmp(current->value, "********") == 0
+				&& (strcmp(key, P_PASSWORD) == 0
+						|| strcmp(key, P_GATEWAY_PW) == 0))
+			continue; // the masked value, unchanged
+		const MppPropertySpec *spec = getSpec(key);
+		uint32_t before = properties.getSequence();
+		if (current->value == NULL)
+			properties.remove(key); // back to the default, if any
+		else
+			properties.putText(key, current->value,
+					(current->flags & KV_QUOTED)
+							&& (spec == NULL || spec->type == MPP_TEXT));
+		if (properties.changedSince(before))
+			changed.put(key, contains(key) ? get(key) : NULL);
+	}
+	if (changes != NULL)
+		*changes = changed.toString(redactions, redactionCount);
+	restartPending |= restart;
+	notifyObservers();
+	save();
+	return true;
+}
+
 void MppProperties::clear() {
 	properties.clear();
+	notifyObservers();
 	save();
 }
 
 bool MppProperties::save() {
-	String target = properties.toString();
-	if (writeProperties(target)) {
-		Serial.printf("Saved properties (%d bytes).\n", target.length());
-//   Serial.println("Properies string"+target);
-		return true;
-	} else
+	if (quiet == 0 && maxDelay == 0)
+		return write();
+	unsigned long now = millis();
+	if (!dirty) {
+		dirty = true;
+		dirtySince = now;
+	}
+	lastChange = now;
+	return true;
+}
+
+void MppProperties::setWriteBehind(unsigned long quiet,
+		unsigned long maxDelay) {
+	this->quiet = quiet;
+	this->maxDelay = maxDelay;
+	if (quiet == 0 && maxDelay == 0)
+		flush();
+	else if (writeBehind != this) {
+		// also covers restarts from sketches (ESP.restart/esp_restart)
+		if (writeBehind == NULL)
+			esp_register_shutdown_handler(flushOnRestart);
+		writeBehind = this;
+		Serial.printf("Properties write-behind %lums (max %lums)\n", quiet,
+				maxDelay);
+	}
+}
+
+// signed, now may have been read before a save in the same loop
+void MppProperties::handle(unsigned long now) {
+	if (dirty
+			&& ((long) (now - lastChange) >= (long) quiet
+					|| (maxDelay > 0 && (long) (now - dirtySince) >= (long) maxDelay)))
+		write();
+	else if (store != NULL)
+		store->handle(properties);
+}
+
+bool MppProperties::flush() {
+	return !dirty || write();
+}
+
+// only what changed since the last save, if the store can
+bool MppProperties::write() {
+	dirty = false; // a failure is not retried until the next change
+	if (store == NULL || !store->save(properties, saved)) {
+		Serial.println("Properties save failed.");
 		return false;
+	}
+	saved = properties.getSequence();
+	Serial.printf("Saved properties (%d).\n", properties.size());
+	return true;
+}
+
+void MppProperties::observe(const char *key, MppPropertyObserver observer) {
+	_Observer *added = new _Observer();
+	added->key = MppJson::intern(key);
+	added->observer = observer;
+	added->set = contains(key) && get(key) != NULL;
+	if (added->set)
+		added->value = get(key);
+	added->next = observers;
+	observers = added;
+	if (notified == 0)
+		notified = properties.getSequence();
+}
+
+// compares the observed keys after any change, changes made by an observer
+// are picked up by the next round
+void MppProperties::notifyObservers() {
+	if (observers == NULL || notifying)
+		return;
+	notifying = true;
+	while (properties.changedSince(notified)) {
+		notified = properties.getSequence();
+		for (_Observer *current = observers; current != NULL;
+				current = current->next) {
+			const char *value = contains(current->key) ? get(current->key) : NULL;
+			if (value == NULL ?
+					!current->set :
+					current->set && current->value == value)
+				continue;
+			String previous = current->value;
+			bool wasSet = current->set;
+			current->value = value == NULL ? "" : value;
+			current->set = value != NULL;
+			current->observer(current->key, wasSet ? previous.c_str() : NULL,
+					current->set ? current->value.c_str() : NULL);
+		}
+	}
+	notifying = false;
+}
+
+bool MppProperties::setRedaction(const char *key, MppRedaction redaction) {
+	key = MppJson::intern(key);
+	for (unsigned i = 0; i < redactionCount; i++)
+		if (redactions[i].key == key) {
+			redactions[i].redaction = redaction;
+			return true;
+		}
+	if (redactionCount == MPP_REDACTIONS)
+		return false;
+	redactions[redactionCount++] = { key, redaction };
+	return true;
 }
 
 String MppProperties::toString() {
-	MppJson result;
-	result.loadFrom(properties.toString());
-	if (result.has(P_PASSWORD) && strlen(result.get(P_PASSWORD)) > 0)
-		result.put(P_PASSWORD, "********");
-	else
-		result.remove(P_PASSWORD);
-	if (result.has(P_GATEWAY_PW))
-		result.put(P_GATEWAY_PW,
-				strlen(result.get(P_GATEWAY_PW)) == 0 ? "" : "********");
-	return result.toString();
+	return properties.toString(redactions, redactionCount);
+}
+
+unsigned MppProperties::length() {
+	return properties.length(redactions, redactionCount);
+}
+
+size_t MppProperties::printTo(Print &out) {
+	return properties.printTo(out, redactions, redactionCount);
 }
 
 int MppProperties::size() {
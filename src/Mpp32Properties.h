@@ -1,5 +1,7 @@
 #include <Arduino.h>
 #include "Mpp32Json.h"
+#include "Mpp32PropertyStore.h"
+#include <functional>
 
 /*
  * MppProperties.h FOR ESP32!!
@@ -11,18 +13,68 @@
 
 extern const char* P_PASSWORD;
 
+// property value types, MPP_TEXT is anything
+enum MppPropertyType {
+	MPP_TEXT, MPP_INT, MPP_UNSIGNED, MPP_FLOAT, MPP_BOOL
+};
+
+// a registered property, values that do not fit are rejected
+struct MppPropertySpec {
+	const char* name;
+	MppPropertyType type;
+	const char* defaultValue; // used when not set or invalid, NULL for none
+	float min; // range of numbers, checked if min < max
+	float max;
+	bool requiresRestart; // read at startup only
+};
+
+#define MPP_REDACTIONS 8 // keys with a redaction policy
+
+// called with the previous and the new value (NULL if not set) of a
+// property after it changed
+typedef std::function<void(const char* key, const char* oldValue,
+		const char* newValue)> MppPropertyObserver;
+
 class MppProperties {
 public:
 	MppProperties();
 	~MppProperties();
+	void setStore(MppPropertyStore* store); // before begin(), NVS by default
 	void begin();
+	// replaces the set, false (nothing changed) if it does not parse or a
+	// value does not fit its definition, see getError()
 	bool update(const String& newProperties);
-	bool save();
+	// json merge patch (RFC 7396) applied in place, absent keys are left as
+	// they are and null removes a key, so only the touched keys are saved.
+	// changes (optional) is set to the changed keys as a json object,
+	// removed as null and the redacted values masked
+	bool patch(const String& mergePatch, String* changes = NULL);
+	// register the type, default and range of a property, the getters return
+	// the default while the property has no value (it is not stored). An
+	// invalid value already set is logged and converted to what the getters
+	// read from it
+	void define(const MppPropertySpec& spec);
+	const MppPropertySpec* getSpec(const char* key); // NULL if not registered
+	// nullptr if ok, else why the value does not fit the definition of key
+	const char* validate(const char* key, const char* value);
+	const String& getError() { return error; } // of the last rejected change
+	// a changed property requires a restart to apply
+	bool isRestartPending() { return restartPending; }
+	bool save(); // or marks the properties for the write-behind
+	// write-behind, save() then only marks the properties dirty and they are
+	// written after quiet ms without changes, or at most maxDelay ms after
+	// the first change (0, 0 saves immediately)
+	void setWriteBehind(unsigned long quiet, unsigned long maxDelay);
+	void handle(unsigned long now); // writes when due, call from the loop
+	bool flush(); // writes now if dirty (e.g. before a restart)
 	void clear();
 	void put(const char* key, const char* value);
-	void remove(const char* key);
-	bool contains(const char* key); // if property is in the set
-	bool has(const char* key); // if property has a value
+	// put() for the value of a registered property (typed, not quoted),
+	// false if it is invalid
+	bool putValid(const char* key, const char* value);
+	void remove(const char* key); // a registered property gets its default
+	bool contains(const char* key); // if property is in the set or has a default
+	bool has(const char* key); // if property has a value (or a default)
 	// returns the property as a string
 	const char *get(const char* key);
 	// returns true if the property is defined and is true
@@ -31,10 +83,48 @@ public:
 	int getInt(const char* key);
 	unsigned getUnsigned(const char* key);
 	float getFloat(const char* key);
+	// for display, in one pass with the redacted values masked
 	String toString();
+	unsigned length(); // of toString()
+	size_t printTo(Print& out); // toString() without building a String
+	// observer is called whenever key changes after this, by any path
+	// (PUT /defaults, /setprops, console set/save, sketch puts)
+	void observe(const char* key, MppPropertyObserver observer);
+	// how the value of key is shown, passwords are masked by default,
+	// false if there is no room for another key
+	bool setRedaction(const char* key, MppRedaction redaction);
 	int size(); // number of k/v pairs
+	unsigned long getLoadMillis() { return loadMillis; } // of begin()
 protected:
 	MppJson properties;
+	MppPropertyStore* store = NULL;
+	uint32_t saved = 0; // sequence of the last save
+	unsigned long quiet = 0;
+	unsigned long maxDelay = 0;
+	bool dirty = false;
+	unsigned long dirtySince = 0; // first unsaved change
+	unsigned long lastChange = 0;
+	unsigned long loadMillis = 0;
+	MppPropertySpec* schema = NULL;
+	unsigned schemaCount = 0;
+	String error;
+	bool restartPending = false;
+	bool write();
+	const char* defaultFor(const char* key);
+	bool changesRestart(const char* key, const char* value);
+	MppRedact redactions[MPP_REDACTIONS];
+	unsigned redactionCount = 0;
+	struct _Observer {
+		const char* key;
+		MppPropertyObserver observer;
+		String value; // as last notified
+		bool set;
+		_Observer* next;
+	};
+	_Observer* observers = NULL;
+	uint32_t notified = 0; // sequence of the last notification
+	bool notifying = false;
+	void notifyObservers();
 };
 
 #endif /* MPP_PROPERTIES_H_ */
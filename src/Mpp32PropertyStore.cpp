@@ -0,0 +1,543 @@
+#include "Mpp32PropertyStore.h"
+#include <EEPROM.h>
+#include <nvs.h>
+
+/*
+ * MppPropertyStore.cpp FOR ESP32!!
+ *
+ */
+
+/******************************************************************************
+ * MppEepromStore
+ *****************************************************************************/
+
+#define MaxProps 1024
+#define MppMarkerLength 14
+#define MppPropertiesLength MaxProps - MppMarkerLength
+static const char MppMarker[MppMarkerLength] = "MppProperties";
+// after the marker either json text (0 terminated) or, saved since, a cbor
+// byte string head with a 16 bit length followed by the cbor map
+#define MppCborBlob 0x59
+#define MppCborHeadLength 3
+
+static bool eepromStarted = false;
+
+// streams the serialized properties into the EEPROM buffer, no copy of the
+// whole set on the stack
+class MppEepromPrint: public Print {
+public:
+	unsigned offset = MppMarkerLength + MppCborHeadLength;
+	size_t write(uint8_t c) {
+		return write(&c, 1);
+	}
+	size_t write(const uint8_t *buffer, size_t size) {
+		size_t written = EEPROM.writeBytes(offset, buffer, size);
+		offset += written;
+		return written;
+	}
+};
+
+bool MppEepromStore::begin() {
+	if (!eepromStarted && !(eepromStarted = EEPROM.begin(MaxProps)))
+		Serial.println("Error Initializing 1024 bytes of EEPROM !");
+	return eepromStarted;
+}
+
+// the emulation keeps the whole region in RAM, parsed there in place
+bool MppEepromStore::load(MppJson &properties) {
+	if (!begin())
+		return false;
+	const char *data = (const char*) EEPROM.getDataPtr();
+	if (data == NULL)
+		return false;
+	if (memcmp(data, MppMarker, MppMarkerLength) != 0) {
+		Serial.printf("EEPROM marker mismatch, found '%.*s'\n",
+				MppMarkerLength - 1, data);
+		return false;
+	}
+	const char *blob = data + MppMarkerLength;
+	unsigned length = 0;
+	unsigned offset = 0;
+	const char* error = nullptr;
+	if ((uint8_t) blob[0] == MppCborBlob) {
+		length = (uint8_t) blob[1] << 8 | (uint8_t) blob[2];
+		if (length > MppPropertiesLength - MppCborHeadLength)
+			error = "Invalid length";
+		else
+			error = properties.loadFrom(blob + MppCborHeadLength, length,
+					&offset, MPP_CBOR);
+	} else {
+		length = strnlen(blob, MppPropertiesLength);
+		error = properties.loadFrom(blob, length, &offset);
+	}
+	if (error) {
+		Serial.printf("Properties.load failed: %s at %u\n", error, offset);
+		return false;
+	}
+	return true;
+}
+
+// as cbor, numbers and booleans are stored without their text
+bool MppEepromStore::save(MppJson &properties, uint32_t since) {
+	(void) since; // always the whole set
+	if (!begin())
+		return false;
+	// checked first, the reserved space also keeps the length in 16 bits
+	unsigned length = properties.length(MPP_CBOR);
+	if (length > MppPropertiesLength - MppCborHeadLength) {
+		Serial.println("Properties do not fit in reserved EEPROM space.");
+		return false;
+	}
+	EEPROM.put(0, MppMarker);
+	uint8_t head[MppCborHeadLength] = { MppCborBlob, (uint8_t) (length >> 8),
+			(uint8_t) length };
+	EEPROM.writeBytes(MppMarkerLength, head, sizeof(head));
+	MppEepromPrint out;
+	properties.printTo(out, MPP_CBOR);
+	EEPROM.commit();
+	return true;
+}
+
+/******************************************************************************
+ * MppNvsStore
+ *****************************************************************************/
+
+#define MppNamespace "MppProperties"
+#define MppNvsFormat "format" // set once the properties are kept here
+// nvs keys are at most 15 characters, properties are stored under "p" and
+// the hex key hash, the next hashes are probed on collisions
+#define MppNvsProbes 4
+// blob: flags, key and 0, value and 0 (none for null)
+#define NVS_QUOTED 0x01
+#define NVS_NULL 0x02
+#define MppNvsLoadBuffer 256 // blobs up to this size are loaded in one read
+
+static void nvsKeyFor(uint32_t hash, unsigned probe, char *nvsKey) {
+	snprintf(nvsKey, 16, "p%08lx", (unsigned long) (hash + probe));
+}
+
+// reads the blob into buffer (of size), false if missing or malformed
+static bool readBlob(nvs_handle_t handle, const char *nvsKey, char *buffer,
+		size_t size) {
+	return nvs_get_blob(handle, nvsKey, buffer, &size) == ESP_OK && size > 2
+			&& buffer[size - 1] == 0;
+}
+
+static size_t blobSize(nvs_handle_t handle, const char *nvsKey) {
+	size_t size = 0;
+	return nvs_get_blob(handle, nvsKey, NULL, &size) == ESP_OK ? size : 0;
+}
+
+MppNvsStore::~MppNvsStore() {
+	if (opened)
+		nvs_close(handle);
+}
+
+bool MppNvsStore::open() {
+	if (!opened)
+		opened = nvs_open(MppNamespace, NVS_READWRITE, &handle) == ESP_OK;
+	return opened;
+}
+
+bool MppNvsStore::load(MppJson &properties) {
+	uint8_t format = 0;
+	if (!open() || nvs_get_u8(handle, MppNvsFormat, &format) != ESP_OK)
+		return false;
+	properties.clear();
+	char buffer[MppNvsLoadBuffer];
+	nvs_iterator_t iterator = NULL;
+	esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, MppNamespace,
+			NVS_TYPE_BLOB, &iterator);
+	while (err == ESP_OK) {
+		nvs_entry_info_t info;
+		nvs_entry_info(iterator, &info);
+		// one read into the buffer, only larger blobs are read again
+		size_t size = sizeof(buffer);
+		char *blob = buffer;
+		esp_err_t read =
+				info.key[0] == 'p' ?
+						nvs_get_blob(handle, info.key, blob, &size) :
+						ESP_ERR_NVS_NOT_FOUND;
+		if (read == ESP_ERR_NVS_INVALID_LENGTH && size > 0
+				&& (blob = (char*) malloc(size)) != NULL)
+			read = nvs_get_blob(handle, info.key, blob, &size);
+		if (read == ESP_OK && size > 2 && blob[size - 1] == 0) {
+			const char *key = blob + 1;
+			unsigned keyLength = strlen(key);
+			const char *value =
+					(blob[0] & NVS_NULL) || keyLength + 2 >= size ?
+							NULL : key + keyLength + 1;
+			properties.putText(key, value, blob[0] & NVS_QUOTED);
+		}
+		if (blob != buffer)
+			free(blob);
+		err = nvs_entry_next(&iterator);
+	}
+	nvs_release_iterator(iterator);
+	return true;
+}
+
+// the nvs key holding the entry, else the first free one of its probes
+bool MppNvsStore::find(const _KV *entry, char *nvsKey, bool *exists) {
+	char candidate[16];
+	*exists = false;
+	nvsKey[0] = 0;
+	for (unsigned probe = 0; probe < MppNvsProbes; probe++) {
+		nvsKeyFor(entry->hash, probe, candidate);
+		size_t size = blobSize(handle, candidate);
+		if (size == 0) {
+			if (nvsKey[0] == 0)
+				strcpy(nvsKey, candidate);
+			continue;
+		}
+		char blob[size];
+		if (readBlob(handle, candidate, blob, size)
+				&& strcmp(blob + 1, entry->key) == 0) {
+			strcpy(nvsKey, candidate);
+			*exists = true;
+			return true;
+		}
+	}
+	return nvsKey[0] != 0;
+}
+
+bool MppNvsStore::write(const _KV *entry) {
+	char nvsKey[16];
+	bool exists;
+	if (!find(entry, nvsKey, &exists)) {
+		Serial.printf("No NVS key left for property %s\n", entry->key);
+		return false;
+	}
+	unsigned keyLength = strlen(entry->key) + 1;
+	unsigned valueLength = entry->value == NULL ? 0 : strlen(entry->value) + 1;
+	char blob[1 + keyLength + valueLength];
+	blob[0] = (entry->flags & KV_QUOTED ? NVS_QUOTED : 0)
+			| (entry->value == NULL ? NVS_NULL : 0);
+	memcpy(blob + 1, entry->key, keyLength);
+	if (valueLength > 0)
+		memcpy(blob + 1 + keyLength, entry->value, valueLength);
+	return nvs_set_blob(handle, nvsKey, blob, sizeof(blob)) == ESP_OK;
+}
+
+bool MppNvsStore::erase(const _KV *entry) {
+	char nvsKey[16];
+	bool exists;
+	if (find(entry, nvsKey, &exists) && exists)
+		return nvs_erase_key(handle, nvsKey) == ESP_OK;
+	return true;
+}
+
+// erases the stored keys that are no longer in properties
+bool MppNvsStore::eraseStale(MppJson &properties) {
+	String stale; // nvs keys, erased after iterating
+	nvs_iterator_t iterator = NULL;
+	esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, MppNamespace,
+			NVS_TYPE_BLOB, &iterator);
+	while (err == ESP_OK) {
+		nvs_entry_info_t info;
+		nvs_entry_info(iterator, &info);
+		size_t size = info.key[0] == 'p' ? blobSize(handle, info.key) : 0;
+		char blob[size + 1];
+		if (size > 0
+				&& (!readBlob(handle, info.key, blob, size)
+						|| !properties.contains(blob + 1))) {
+			stale += info.key;
+			stale += ' ';
+		}
+		err = nvs_entry_next(&iterator);
+	}
+	nvs_release_iterator(iterator);
+	bool result = true;
+	for (int start = 0, end; (end = stale.indexOf(' ', start)) > 0; start =
+			end + 1)
+		result &= nvs_erase_key(handle, stale.substring(start, end).c_str())
+				== ESP_OK;
+	return result;
+}
+
+bool MppNvsStore::save(MppJson &properties, uint32_t since) {
+	if (!open())
+		return false;
+	bool result = true;
+	if (!properties.isDeltaComplete(since)) {
+		// removals were compacted away, drop whatever is no longer set
+		result = eraseStale(properties);
+		since = 0;
+	}
+	for (const _KV *entry = properties.getNextChange(NULL, since);
+			entry != NULL; entry = properties.getNextChange(entry, since))
+		result &= entry->flags & KV_ABSENT ? erase(entry) : write(entry);
+	result &= nvs_set_u8(handle, MppNvsFormat, 1) == ESP_OK;
+	result &= nvs_commit(handle) == ESP_OK;
+	return result;
+}
+
+/******************************************************************************
+ * MppPagedStore
+ *****************************************************************************/
+
+#define MppPagedNamespace "MppPaged"
+#define MppPagedHead "head"
+#define MppPagedVersion 1
+#define MppPageSize 1024
+// LZSS: a flag byte for the next 8 items, a set bit is a literal byte, a
+// clear one a match of 2 bytes, distance - 1 (10 bits) and length - 3
+#define LZ_WINDOW 1024
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 66
+
+struct PagedHead {
+	uint8_t version;
+	uint8_t bank;
+	uint16_t pages;
+	uint32_t length; // of the records
+	uint32_t packed;
+	uint32_t crc; // of the packed pages
+};
+
+static void pageName(uint8_t bank, unsigned page, char *name) {
+	snprintf(name, 16, "%c%u", 'a' + bank, page);
+}
+
+// unpacks page by page into the records, adding them as they complete,
+// so only the window is kept
+class PagedReader {
+public:
+	PagedReader(MppJson &properties) : properties(properties) {}
+	void unpack(const uint8_t *data, unsigned length);
+	bool complete(uint32_t length) {
+		return unpacked == length && part == 0 && match < 0;
+	}
+private:
+	MppJson &properties;
+	uint8_t window[LZ_WINDOW];
+	uint32_t unpacked = 0;
+	uint8_t flags = 0;
+	unsigned items = 0; // left of the flag byte
+	int match = -1; // first byte of a match
+	unsigned part = 0; // of the record: flags, key, value
+	uint8_t recordFlags = 0;
+	String key;
+	String value;
+	void output(uint8_t c);
+};
+
+void PagedReader::unpack(const uint8_t *data, unsigned length) {
+	for (unsigned i = 0; i < length; i++) {
+		uint8_t c = data[i];
+		if (items == 0) {
+			flags = c;
+			items = 8;
+		} else if (match >= 0) {
+			unsigned distance = ((match << 2) | (c >> 6)) + 1;
+			for (unsigned n = (c & 0x3F) + LZ_MIN_MATCH; n > 0; n--)
+				output(window[(unpacked - distance) % LZ_WINDOW]);
+			match = -1;
+			--items;
+		} else if (flags & (1 << (8 - items))) {
+			output(c);
+			--items;
+		} else
+			match = c;
+	}
+}
+
+void PagedReader::output(uint8_t c) {
+	window[unpacked++ % LZ_WINDOW] = c;
+	if (part == 0) {
+		recordFlags = c;
+		key = "";
+		value = "";
+		part = 1;
+	} else if (c != 0)
+		(part == 1 ? key : value) += (char) c;
+	else if (part == 1 && !(recordFlags & NVS_NULL))
+		part = 2;
+	else {
+		properties.putText(key.c_str(),
+				recordFlags & NVS_NULL ? NULL : value.c_str(),
+				recordFlags & NVS_QUOTED);
+		part = 0;
+	}
+}
+
+// packs into pages of the bank, written as they fill
+class PagedWriter {
+public:
+	PagedWriter(uint32_t handle, uint8_t bank) : handle(handle), bank(bank) {}
+	bool pack(const uint8_t *data, unsigned length);
+	uint16_t pages = 0;
+	uint32_t packed = 0;
+	uint32_t crc = 0;
+private:
+	uint32_t handle;
+	uint8_t bank;
+	uint8_t page[MppPageSize];
+	unsigned used = 0;
+	bool append(const uint8_t *data, unsigned length);
+	bool flush();
+};
+
+bool PagedWriter::pack(const uint8_t *data, unsigned length) {
+	uint8_t group[1 + 8 * 2];
+	unsigned items = 0, size = 1;
+	group[0] = 0;
+	for (unsigned i = 0; i < length;) {
+		// longest match in the window, plain search as saves are rare
+		unsigned best = 0, distance = 0;
+		unsigned limit = length - i < LZ_MAX_MATCH ? length - i : LZ_MAX_MATCH;
+		for (unsigned j = i > LZ_WINDOW ? i - LZ_WINDOW : 0; j < i; j++) {
+			unsigned n = 0;
+			while (n < limit && data[j + n] == data[i + n])
+				n++;
+			if (n > best) {
+				best = n;
+				distance = i - j;
+			}
+		}
+		if (best >= LZ_MIN_MATCH) {
+			group[size++] = (distance - 1) >> 2;
+			group[size++] = (distance - 1) << 6 | (best - LZ_MIN_MATCH);
+			i += best;
+		} else {
+			group[0] |= 1 << items;
+			group[size++] = data[i++];
+		}
+		if (++items == 8 || i == length) {
+			if (!append(group, size))
+				return false;
+			items = 0;
+			size = 1;
+			group[0] = 0;
+		}
+	}
+	return flush();
+}
+
+bool PagedWriter::append(const uint8_t *data, unsigned length) {
+	for (unsigned i = 0; i < length; i++) {
+		if (used == MppPageSize && !flush())
+			return false;
+		page[used++] = data[i];
+	}
+	return true;
+}
+
+bool PagedWriter::flush() {
+	if (used == 0)
+		return true;
+	char name[16];
+	pageName(bank, pages, name);
+	if (nvs_set_blob(handle, name, page, used) != ESP_OK)
+		return false;
+	crc = mppCrc32(page, used, crc);
+	packed += used;
+	++pages;
+	used = 0;
+	return true;
+}
+
+MppPagedStore::~MppPagedStore() {
+	if (opened)
+		nvs_close(handle);
+}
+
+bool MppPagedStore::open() {
+	if (!opened)
+		opened = nvs_open(MppPagedNamespace, NVS_READWRITE, &handle) == ESP_OK;
+	return opened;
+}
+
+void MppPagedStore::erasePages(uint8_t bank) {
+	char name[16];
+	for (unsigned page = 0;; page++) {
+		pageName(bank, page, name);
+		if (nvs_erase_key(handle, name) != ESP_OK)
+			break;
+	}
+}
+
+bool MppPagedStore::load(MppJson &properties) {
+	PagedHead head;
+	size_t size = sizeof(head);
+	if (!open()
+			|| nvs_get_blob(handle, MppPagedHead, &head, &size) != ESP_OK
+			|| size != sizeof(head) || head.version != MppPagedVersion)
+		return false;
+	bank = head.bank;
+	uint8_t *page = (uint8_t*) malloc(MppPageSize);
+	PagedReader *reader = new PagedReader(properties);
+	uint32_t crc = 0, packed = 0;
+	bool result = page != NULL;
+	properties.clear();
+	for (unsigned i = 0; result && i < head.pages; i++) {
+		char name[16];
+		pageName(head.bank, i, name);
+		size = MppPageSize;
+		result = nvs_get_blob(handle, name, page, &size) == ESP_OK;
+		if (result) {
+			crc = mppCrc32(page, size, crc);
+			packed += size;
+			reader->unpack(page, size);
+		}
+	}
+	result = result && packed == head.packed && crc == head.crc
+			&& reader->complete(head.length);
+	delete reader;
+	free(page);
+	if (!result) {
+		Serial.println("Paged properties damaged");
+		properties.clear();
+	}
+	return result;
+}
+
+// always the whole set, into the other bank
+bool MppPagedStore::save(MppJson &properties, uint32_t since) {
+	if (!open())
+		return false;
+	if (properties.isDeltaComplete(since)
+			&& properties.getNextChange(NULL, since) == NULL)
+		return true; // unchanged
+	unsigned length = 0;
+	for (const _KV *entry = properties.getFirst(); entry != NULL; entry =
+			properties.getNext(entry))
+		length += 1 + strlen(entry->key) + 1
+				+ (entry->value == NULL ? 0 : strlen(entry->value) + 1);
+	uint8_t *records = (uint8_t*) malloc(length + 1);
+	PagedWriter *writer = new PagedWriter(handle, bank ^ 1);
+	if (records == NULL || writer == NULL) {
+		free(records);
+		delete writer;
+		return false;
+	}
+	unsigned at = 0;
+	for (const _KV *entry = properties.getFirst(); entry != NULL; entry =
+			properties.getNext(entry)) {
+		records[at++] = (entry->flags & KV_QUOTED ? NVS_QUOTED : 0)
+				| (entry->value == NULL ? NVS_NULL : 0);
+		strcpy((char*) records + at, entry->key);
+		at += strlen(entry->key) + 1;
+		if (entry->value != NULL) {
+			strcpy((char*) records + at, entry->value);
+			at += strlen(entry->value) + 1;
+		}
+	}
+	erasePages(bank ^ 1); // left from the save before the last one
+	bool result = writer->pack(records, length);
+	PagedHead head = { MppPagedVersion, (uint8_t) (bank ^ 1), writer->pages,
+			length, writer->packed, writer->crc };
+	result = result
+			&& nvs_set_blob(handle, MppPagedHead, &head, sizeof(head)) == ESP_OK
+			&& nvs_commit(handle) == ESP_OK;
+	if (result) {
+		Serial.printf("Properties packed %u into %u bytes, %u pages\n", length,
+				(unsigned) head.packed, head.pages);
+		erasePages(bank);
+		bank ^= 1;
+		nvs_commit(handle);
+	}
+	delete writer;
+	free(records);
+	return result;
+}
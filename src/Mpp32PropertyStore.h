@@ -0,0 +1,73 @@
+#include <Arduino.h>
+#include "Mpp32Json.h"
+
+/*
+ * MppPropertyStore.h FOR ESP32!!
+ *
+ * Where MppProperties are persisted.  A store loads the whole set at
+ * startup and is then asked to save the changes since its last save, so
+ * stores that can write single keys only touch what changed.
+ *
+ */
+
+#ifndef MPP_PROPERTY_STORE_H_
+#define MPP_PROPERTY_STORE_H_
+
+// CRC-32 (IEEE), continues from crc when given the previous result
+uint32_t mppCrc32(const void* data, unsigned length, uint32_t crc = 0);
+
+class MppPropertyStore {
+public:
+	virtual ~MppPropertyStore() {}
+	// false if nothing was ever saved to this store (or it is unreadable)
+	virtual bool load(MppJson& properties) = 0;
+	// the changes after since, everything when the delta is not complete
+	virtual bool save(MppJson& properties, uint32_t since) = 0;
+	// called from the loop, e.g. for housekeeping off the save path
+	virtual void handle(MppJson& properties) { (void) properties; }
+};
+
+// the whole set as one blob after the "MppProperties" marker in the 1024
+// byte EEPROM emulation, rewritten on every save
+class MppEepromStore: public MppPropertyStore {
+public:
+	bool load(MppJson& properties);
+	bool save(MppJson& properties, uint32_t since);
+private:
+	bool begin();
+};
+
+// one NVS blob per property, a save writes or erases only the changed keys
+class MppNvsStore: public MppPropertyStore {
+public:
+	~MppNvsStore();
+	bool load(MppJson& properties);
+	bool save(MppJson& properties, uint32_t since);
+private:
+	uint32_t handle = 0; // nvs_handle_t
+	bool opened = false;
+	bool open();
+	bool find(const _KV* entry, char* nvsKey, bool* exists);
+	bool write(const _KV* entry);
+	bool erase(const _KV* entry);
+	bool eraseStale(MppJson& properties);
+};
+
+// the whole set as records (like the MppNvsStore blobs) packed with a small
+// LZ codec and split into NVS blobs of MppPageSize, so it is not limited to
+// one blob or the EEPROM size.  The pages go to the other of two banks
+// before the head is switched over to it.
+class MppPagedStore: public MppPropertyStore {
+public:
+	~MppPagedStore();
+	bool load(MppJson& properties);
+	bool save(MppJson& properties, uint32_t since);
+private:
+	uint32_t handle = 0; // nvs_handle_t
+	bool opened = false;
+	uint8_t bank = 0; // of the saved pages
+	bool open();
+	void erasePages(uint8_t bank);
+};
+
+#endif /* MPP_PROPERTY_STORE_H_ */
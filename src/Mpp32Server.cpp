@@ -26,6 +26,7 @@ const char *VERSION = "MppArduino32Eth 1.2.0";
 const char *P_BUTTON_PIN = "ButtonPin";
 const char *P_Ethernet_RESTART="Ethernet wait to restart";
 const char *P_NO_MULTICAST = "NoMulticast";
+const char *P_NOTIFY_GROUP = "NotifyGroup";
 // const char *P_USE_STATIC_IP = "StaticIp";
 const char *P_IP = "ip";
 const char *P_GW = "gw";
@@ -33,6 +34,8 @@ const char *P_NM = "nm";
 const char *P_SSID = "ssid";  //Keep that field for Ethernet
 
 const char *P_NICKNAME = "Nickname";
+const char *P_SAVE_DELAY = "SaveDelay";
+const char *P_SAVE_MAX_DELAY = "SaveMaxDelay";
 
 const char *USERNAME = "admin";
 
@@ -46,11 +49,24 @@ bool eth_connected = false;
 static const char *Managed[] = { P_NICKNAME, //
     P_Ethernet_RESTART, // Times in sec waiting Ethernet connection to restart the chip
 		P_NO_MULTICAST, // suppress multicast join
+		P_NOTIFY_GROUP, // ip[:port] or true for the discovery group, multicast subscriber notifications
 	//	P_USE_STATIC_IP, 
 	  P_IP, P_GW, P_NM, // always static IP configuration
+		P_SAVE_DELAY, // ms without changes before properties are written, 0 immediately
+		P_SAVE_MAX_DELAY, // ms after the first change at most, default 4 x SaveDelay
 		P_PASSWORD // for secure devices
 		};
 
+// managed properties with a type, the others are text
+static const MppPropertySpec ManagedSpecs[] = { //
+		{ P_Ethernet_RESTART, MPP_UNSIGNED, NULL, 0, 0, false }, //
+		{ P_NO_MULTICAST, MPP_BOOL, NULL, 0, 0, true }, //
+		{ P_NOTIFY_GROUP, MPP_TEXT, NULL, 0, 0, true }, //
+		{ P_SAVE_DELAY, MPP_UNSIGNED, NULL, 0, 0, true }, //
+		{ P_SAVE_MAX_DELAY, MPP_UNSIGNED, NULL, 0, 0, true }, //
+		{ P_BUTTON_PIN, MPP_UNSIGNED, NULL, 0, 39, true } //
+};
+
 
 bool isEthernetReady() {
 	return eth_connected && ETH.localIP();
@@ -102,6 +118,7 @@ const int MulticastPort = 8898;
 
 static const char *CONTENT_LENGTH = "Content-Length";
 static const char *APPL_JSON = "application/json";
+static const char *APPL_CBOR = "application/cbor";
 static const char *TEXT_HTML = "text/html";
 static const char *TEXT_PLAIN = "text/plain";
 static String UID;
@@ -128,22 +145,38 @@ void MppServer::webHandleProps() {
 }
 
 void MppServer::sendProperties(WebServer &server) {
-	String result = properties.toString();
-	server.sendHeader(CONTENT_LENGTH, String(result.length()));
 	String filename = "attachment; filename=\"" + getUID() + ".props\"";
 	server.sendHeader("Content-Disposition", filename);
-	server.send(200, APPL_JSON, result);
+	// headers only, the json is streamed to the client
+	server.setContentLength(properties.length());
+	server.send(200, APPL_JSON, "");
+	properties.printTo(server.client());
 }
 
 void MppServer::mppHandleProps() {
 	if (mppServer.method() == HTTP_GET) {
 		sendProperties(mppServer);
+	} else if (mppServer.method() == HTTP_PATCH
+			|| (mppServer.method() == HTTP_PUT && mppServer.arg("merge") == "true")) {
+		bool authenticated = (!hasProperty(P_PASSWORD)
+				|| mppServer.authenticate(USERNAME, getProperty(P_PASSWORD)));
+		if (!authenticated)
+			return mppServer.requestAuthentication();
+		String changes;
+		if (!properties.patch(mppServer.arg("plain"), &changes))
+			return mppServer.send(400, TEXT_PLAIN, properties.getError());
+		if (properties.isRestartPending())
+			mppServer.sendHeader("Restart-Required", "true");
+		mppServer.send(200, APPL_JSON, changes);
 	} else if (mppServer.method() == HTTP_PUT) {
 		bool authenticated = (!hasProperty(P_PASSWORD)
 				|| mppServer.authenticate(USERNAME, getProperty(P_PASSWORD)));
 		if (!authenticated)
 			return mppServer.requestAuthentication();
-		properties.update(mppServer.arg("plain"));
+		if (!properties.update(mppServer.arg("plain")))
+			return mppServer.send(400, TEXT_PLAIN, properties.getError());
+		if (properties.isRestartPending())
+			mppServer.sendHeader("Restart-Required", "true");
 		sendProperties(mppServer);
 	} else
 		mppServer.send(501);
@@ -175,6 +208,7 @@ void MppServer::webHandleRestart() {
 	Serial.println(F("Restarting..."));
 	webSendBackForm(F("Restarting..."));
 	delay(250);
+	properties.flush();
 	ESP.restart();
 }
 
@@ -207,11 +241,14 @@ void MppServer::webHandleSetProperty() {
 	if (key.length()) {
 		if (!value.length())
 			properties.remove(key.c_str());
-		else
-			properties.put(key.c_str(), value.c_str());
+		else if (!properties.putValid(key.c_str(), value.c_str()))
+			return webSendBackForm(properties.getError(), 400);
 	}
 	if (properties.save())
-		webSendBackForm(F("Properties updated, restart to apply."));
+		webSendBackForm(
+				properties.isRestartPending() ?
+						F("Properties updated, restart to apply.") :
+						F("Properties updated."));
 	else
 		webSendBackForm(
 				F("Properties updated failed (too long).  Restart to recover."),
@@ -227,6 +264,33 @@ int sendBroadcast(String message) {
 	return result;
 }
 
+// multicast subscribers share a datagram to this group (opt-in), by
+// default the one used for discovery and broadcasts
+void MppServer::startNotifyGroup() {
+	String group = hasProperty(P_NOTIFY_GROUP) ? getProperty(P_NOTIFY_GROUP) : "";
+	if (group.length() == 0 || group == "false")
+		return;
+	IPAddress address = MPP_ADDRESS;
+	int port = MulticastPort;
+	if (group != "true") {
+		int i = group.indexOf(':');
+		if (i > 0) {
+			port = group.substring(i + 1).toInt();
+			group = group.substring(0, i);
+		}
+		if (!address.fromString(group.c_str()) || address[0] < 224 || address[0] > 239
+				|| port <= 0) {
+			Serial.printf("%s %s is not a multicast group\n", P_NOTIFY_GROUP,
+					getProperty(P_NOTIFY_GROUP));
+			return;
+		}
+	}
+	notifyGroup = address.toString() + ":" + port;
+	MppDevice::setMulticastGroup(address, port);
+	Serial.printf("Multicast subscribers are notified at %s\n",
+			notifyGroup.c_str());
+}
+
 void MppServer::broadcastMessage(String message) {
 	sendBroadcast("OUT: " + message);
 }
@@ -270,13 +334,11 @@ void MppServer::handleClients() {
 
 	if (!isEthernetReady()) {
    Serial.print(".");
-		if (getUnsignedProperty(P_Ethernet_RESTART) > 0
-				&& millis()
-						> EthConnect
-								+ getUnsignedProperty(P_Ethernet_RESTART) * 60
-										* 1000) {
+		unsigned restart = getUnsignedProperty(P_Ethernet_RESTART);
+		if (restart > 0 && millis() > EthConnect + restart * 60 * 1000) {
 			Serial.println("\nNo Ip within timeout, restarting...\n");
 			delay(1000);
+			properties.flush();
 			ESP.restart();
 		}
 	} else
@@ -284,6 +346,7 @@ void MppServer::handleClients() {
 
 	webServer.handleClient();
 	mppServer.handleClient();
+	properties.handle(millis()); // after the handlers, they may have saved
 
 	if (console.hasClient()) {
 		Serial.println("Starting new console client!");
@@ -361,15 +424,54 @@ String MppServer::getDiscovery() {
 	return result;
 }
 
+unsigned MppServer::getCborDiscoveryLength() {
+	char head[5];
+	unsigned length = MppJson::cborArray(head, deviceCount);
+	for (unsigned i = 0; i < deviceCount; i++)
+		length += devices[i]->getJsonLength(MPP_CBOR);
+	return length;
+}
+
+size_t MppServer::printCborDiscovery(Print &out) {
+	char head[5];
+	size_t result = out.write((const uint8_t*) head,
+			MppJson::cborArray(head, deviceCount));
+	for (unsigned i = 0; i < deviceCount; i++)
+		result += devices[i]->printJson(out, MPP_CBOR);
+	return result;
+}
+
 void MppServer::mppHandleDiscovery() {
-	mppServer.send(200, APPL_JSON, getDiscovery());
+	if (mppServer.arg("format") == "cbor") {
+		mppServer.setContentLength(getCborDiscoveryLength());
+		mppServer.send(200, APPL_CBOR, "");
+		printCborDiscovery(mppServer.client());
+	} else
+		mppServer.send(200, APPL_JSON, getDiscovery());
 }
 
 void MppServer::mppHandleState(String udnString) {
 //	MppSerial.printf("mppHandleState processing %s\n", mppServer.uri().c_str());
 	MppDevice *device = getDevice(udnString);
-	if (device != NULL)
-		mppServer.send(200, APPL_JSON, device->getJson());
+	if (device == NULL)
+		return;
+	if (mppServer.hasArg("since")) {
+		// only what changed after the sequence the client last saw, all of
+		// it ("full":true) if that was before a reboot
+		uint32_t since = strtoul(mppServer.arg("since").c_str(), NULL, 10);
+		if (!device->changedSince(since)) {
+			mppServer.send(304);
+			return;
+		}
+		mppServer.setContentLength(device->getDeltaLength(since));
+		mppServer.send(200, APPL_JSON, "");
+		device->printDelta(mppServer.client(), since);
+	} else {
+		// headers only, the json is streamed to the client
+		mppServer.setContentLength(device->getJsonLength());
+		mppServer.send(200, APPL_JSON, "");
+		device->printJson(mppServer.client());
+	}
 }
 
 void MppServer::mppHandleName(String udnString) {
@@ -380,10 +482,10 @@ void MppServer::mppHandleName(String udnString) {
 		String nameKey = "Name";
 		nameKey += device->getUdn();
 		if (!newName.length()) {
-			device->put("name", udnString.c_str());
+			device->put(NAME, udnString.c_str());
 			properties.remove(nameKey.c_str());
 		} else {
-			device->put("name", newName.c_str());
+			device->put(NAME, newName.c_str());
 			properties.put(nameKey.c_str(), newName.c_str());
 		}
 		mppServer.send(properties.save() ? 200 : 413);
@@ -395,10 +497,12 @@ void MppServer::mppHandleSetup(MppParameters parms) {
 	String body = parms.getParameter("plain");
 	if (body.length() > 0) {
 		MppJson properties;
-		const char *error = properties.loadFrom(body);
+		unsigned offset;
+		const char *error = properties.loadFrom(body.c_str(), body.length(),
+				&offset);
 		if (error) {
-      mppServer.send(400, error);
-			Serial.println("Properties NOT loaded!");
+      mppServer.send(400, TEXT_PLAIN, String(error) + " at " + offset);
+			Serial.printf("Properties NOT loaded: %s at %u\n", error, offset);
 			delay(500); // allow response to send
 		} else {
 			mppServer.send(200);
@@ -425,8 +529,14 @@ void MppServer::mppHandleSubscribe() {
 Serial.printf("mppHandleSubscribe processing %s from %s\n",
 			mppServer.uri().c_str(), ip.c_str());
 	if (ip.length() > 0) {
-		MppDevice::addSubscriber(ip, port);
-		mppServer.send(200);
+		bool multicast = mppServer.arg("mode") == "multicast";
+		MppDevice::addSubscriber(ip, port, mppServer.arg("format") == "cbor",
+				multicast);
+		// the group to join, without one notifications are sent to ip:port
+		if (multicast && notifyGroup.length() > 0)
+			mppServer.send(200, TEXT_PLAIN, notifyGroup);
+		else
+			mppServer.send(200);
 	} else
 		mppServer.send(400);
 }
@@ -544,6 +654,7 @@ void MppServer::mppHandleRestart() {
 	Serial.println(F("Restarting..."));
 	mppServer.send(200);
 	delay(250);
+	properties.flush();
 	ESP.restart();
 }
 
@@ -558,17 +669,25 @@ int MppServer::handleIncomingUdp(NetworkUDP &serverUdp, int packetSize) {
 		incoming[len] = 0;
 //		MppSerial.printf("UDP packet contents: %s\n", incoming);
 		if (String(incoming).startsWith("discover"))
-			sendDiscoveryResponse(serverUdp.remoteIP(), ServerUdp.remotePort());
+			sendDiscoveryResponse(serverUdp.remoteIP(), ServerUdp.remotePort(),
+					strstr(incoming, "cbor") != NULL);
 	}
 	return OK;
 }
 
-void MppServer::sendDiscoveryResponse(IPAddress remoteIp, int remotePort) {
+void MppServer::sendDiscoveryResponse(IPAddress remoteIp, int remotePort,
+		bool binary) {
 	Serial.printf("Responding to discovery request from %s:%d\n",
 			remoteIp.toString().c_str(), remotePort);
 	// send discovery reply
+	int result;
 	ServerUdp.beginPacket(remoteIp, remotePort);
-	int result = ServerUdp.write((const uint8_t *)getDiscovery().c_str(),getDiscovery().length());
+	if (binary)
+		result = printCborDiscovery(ServerUdp);
+	else {
+		String discovery = getDiscovery();
+		result = ServerUdp.write((const uint8_t *)discovery.c_str(),discovery.length());
+	}
 	ServerUdp.endPacket();
 	Serial.printf("Sent discovery response to %s:%d (%d bytes sent)\n",
 			remoteIp.toString().c_str(), remotePort, result);
@@ -634,6 +753,11 @@ void MppServer::onEventStatic(arduino_event_id_t event) {
   }
 
 void MppServer::begin() {
+	// after setup, so sketch defaults apply too
+	unsigned saveDelay = getUnsignedProperty(P_SAVE_DELAY);
+	unsigned saveMaxDelay = getUnsignedProperty(P_SAVE_MAX_DELAY);
+	properties.setWriteBehind(saveDelay,
+			saveMaxDelay > 0 ? saveMaxDelay : saveDelay * 4);
   if(ETH.macAddress()=="00:00:00:00:00:00") {
   if( ETH.begin(ETH_PHY_TYPE,ETH_PHY_ADDR, ETH_PHY_MDC, ETH_PHY_MDIO, ETH_PHY_POWER, ETH_CLK_MODE))
     {
@@ -653,6 +777,10 @@ void MppServer::begin() {
     noteProperty("uid", getUID().c_str());
 	for (unsigned i = 0; i < deviceCount; i++)
 		devices[i]->begin();
+#ifdef MPP_NOTIFY_TASK
+	MppDevice::startDispatcher(MPP_NOTIFY_TASK);
+#endif
+	startNotifyGroup();
 
 }
 
@@ -667,7 +795,7 @@ void MppServer::removeProperty(const char *property) {
 	}
 }
 
-void MppServer::putProperty(const char *property, const char *value) {
+bool MppServer::putProperty(const char *property, const char *value) {
 // Serial.printf("putProperty 1 pointer:%p, value:%p\n",property,value);
 	bool changed = false;
 	if (properties.contains(property)) {
@@ -682,9 +810,11 @@ void MppServer::putProperty(const char *property, const char *value) {
 		changed = true;
 	if (changed) {
 // Serial.printf("putProperty 2 pointer:%p, value:%p changed:%d \n",property,value,changed);
-		properties.put(property, value);
+		if (!properties.putValid(property, value))
+			return false;
 		properties.save();
 	}
+	return true;
 }
 
 void MppServer::noteProperty(const char *property, const char *value) {
@@ -692,6 +822,24 @@ void MppServer::noteProperty(const char *property, const char *value) {
 	// noted properties are not persisted
 }
 
+void MppServer::registerProperty(const char *property, MppPropertyType type,
+		const char *defaultValue, float min, float max, bool requiresRestart) {
+	MppPropertySpec spec = { property, type, defaultValue, min, max,
+			requiresRestart };
+	properties.define(spec);
+}
+
+void MppServer::registerProperties(const MppPropertySpec specs[],
+		unsigned count) {
+	for (unsigned i = 0; i < count; i++)
+		properties.define(specs[i]);
+}
+
+void MppServer::onPropertyChange(const char *property,
+		MppPropertyObserver observer) {
+	properties.observe(property, observer);
+}
+
 bool MppServer::usesProperty(const char *property) {
 	return properties.contains(property);
 }
@@ -702,20 +850,21 @@ void MppServer::setPropertyDefault(const char *property, const char *value) {
 	// property defaults don't need to be persisted
 }
 
+// typed reads are a single lookup, 0/false if not set
 int MppServer::getIntProperty(const char *property) {
-	return hasProperty(property) ? properties.getInt(property) : 0;
+	return properties.getInt(property);
 }
 
 unsigned MppServer::getUnsignedProperty(const char *property) {
-	return hasProperty(property) ? properties.getUnsigned(property) : 0;
+	return properties.getUnsigned(property);
 }
 
 float MppServer::getFloatProperty(const char *property) {
-	return hasProperty(property) ? properties.getFloat(property) : 0;
+	return properties.getFloat(property);
 }
 
 bool MppServer::isProperty(const char *property) {
-	return hasProperty(property) ? properties.is(property) : false;
+	return properties.is(property);
 }
 
 bool MppServer::hasProperty(const char *property) {
@@ -748,6 +897,14 @@ static void assignProperties(const char *keys[], unsigned count,
 				properties->put(keys[i], NULL);
 }
 
+// property names are constants, share them rather than copying the keys
+// (before loading so the stored properties use them too)
+static void internProperties(const char *keys[], unsigned count) {
+	if (keys != NULL)
+		for (unsigned int i = 0; i < count && keys[i]; i++)
+			MppJson::intern(keys[i]);
+}
+
 void MppServer::setup(const char *deviceVersion, const char *supported[],
 		unsigned count, unsigned baud) {
 
@@ -760,9 +917,13 @@ void MppServer::setup(const char *deviceVersion, const char *supported[],
 	devices = (MppDevice**) calloc(0, sizeof(MppDevice*));
 
  
+	internProperties(supported, count);
+	internProperties(Managed, sizeof(Managed) / sizeof(char*));
+	MppJson::intern(P_GATEWAY_PW);
 	 properties.begin();
 	assignProperties(supported, count, &properties);
 	assignProperties(Managed, sizeof(Managed) / sizeof(char*), &properties);
+	registerProperties(ManagedSpecs, sizeof(ManagedSpecs) / sizeof(MppPropertySpec));
 
 // device versions
 	noteProperty("Version", VERSION);
@@ -825,6 +986,7 @@ bool MppServer::processCommand(String input) {
 		 if (input.startsWith("restart")) {
 			Serial.println("Restarting...");
 			delay(500);
+			properties.flush();
 			ESP.restart();
 		} else if (input.startsWith("remove ")) {
 			char string[input.length() + 1];
@@ -839,20 +1001,34 @@ bool MppServer::processCommand(String input) {
 			strtok(string, " "); // strip off prop
 			String key = strtok(NULL, " ");
 			const char *value = strtok(NULL, "");
+			bool accepted = true;
 			if (value == NULL)
 				removeProperty(key.c_str());
 			else if (!(key.equals(P_PASSWORD) || key.equals(P_GATEWAY_PW))
 					|| strcmp(value, "********") != 0)
-				putProperty(key.c_str(), value);
-			Serial.printf("%s is now '%s'\n", key.c_str(),
-					value == NULL ? "<null>" : value);
+				accepted = putProperty(key.c_str(), value);
+			if (!accepted)
+				Serial.println(properties.getError());
+			else
+				Serial.printf("%s is now '%s'%s\n", key.c_str(),
+						value == NULL ? "<null>" : value,
+						properties.isRestartPending() ?
+								", restart to apply" : "");
 		} else if (input.startsWith("props")
 				|| input.startsWith("properties")) {
 			Serial.println(properties.toString());
+		} else if (input.startsWith("patch ")) {
+			String changes;
+			if (properties.patch(input.substring(6), &changes))
+				Serial.println(changes);
+			else
+				Serial.println(properties.getError());
 		} else if (input.startsWith("save ")) {
 			if (input.length() > 6) {
-				properties.update(input.substring(5));
-				Serial.println(properties.toString());
+				if (properties.update(input.substring(5)))
+					Serial.println(properties.toString());
+				else
+					Serial.println(properties.getError());
 			}
 		} else if (input.startsWith("clear")) {
 			properties.clear();
@@ -864,6 +1040,20 @@ bool MppServer::processCommand(String input) {
 			for (unsigned i = 0; i < deviceCount; i++)
 				Serial.println(devices[i]->getJson());
 		} 
+		else if (input.startsWith("subscribers")) {
+			MppSubscriptionStats stats = MppDevice::getSubscriptionStats();
+			Serial.printf("Subscribers: %u of %u (%u multicast%s%s), added %lu, "
+					"expired %lu, evicted %lu\n", stats.count, stats.capacity,
+					stats.listeners, notifyGroup.length() > 0 ? " at " : "",
+					notifyGroup.c_str(), stats.added, stats.expired, stats.evicted);
+			MppNotifyStats notify = MppDevice::getNotifyStats();
+			Serial.printf("Notifications: %s, waiting %u (max %u), queued %lu, "
+					"coalesced %lu, dropped %lu, sent %lu\n",
+					notify.async ? "async" : "sync", notify.depth, notify.maxDepth,
+					notify.queued, notify.coalesced, notify.dropped, notify.sent);
+			Serial.printf("Notification latency: last %luus, average %luus, max %luus\n",
+					notify.lastLatency, notify.averageLatency, notify.maxLatency);
+		}
 		else if (input.startsWith("gpio ")) {
 			char string[input.length() + 1];
 			input.toCharArray(string, sizeof(string));
@@ -909,6 +1099,11 @@ bool MppServer::processCommand(String input) {
   Serial.printf("This chip has %d cores\n", ESP.getChipCores());
   Serial.print("Chip ID(EMAC): ");
   Serial.println(chipId);
+			Serial.printf("Free heap: %lu bytes, interned keys: %u, json allocations: %u\n",
+					ESP.getFreeHeap(), MppJson::internedKeys(),
+					MppJson::heapAllocations());
+			Serial.printf("Properties loaded in %lums at boot\n",
+					properties.getLoadMillis());
 			Serial.printf("Flash ide  size: %lu bytes\n", ideSize);
 			Serial.printf("Flash ide speed: %lu MHz\n",
 					ESP.getFlashChipSpeed() / 1000000);
@@ -928,11 +1123,13 @@ bool MppServer::processCommand(String input) {
 							"\n mppinfo - show mpp version info"
 									"\n memory - show esp memory info"
 									"\n save [json] - update all properties"
+									"\n patch [json] - merge into properties, null removes"
 									"\n set {key} {value} - update property"
 									"\n remove {key} - remove property"
 									"\n properties - show properties"
 									"\n clear - clear properties"
 									"\n devices - show device information"
+									"\n subscribers - show subscription and notification counts"
 									"\n eraseConfig - erase WiFi config"
 									"\n restart - restart device"
 									"\n gpio {n} - read gpio pin"
@@ -1002,6 +1199,7 @@ void MppServer::webHandleUploadedUpdate() {
 	else {
 		webSendBackForm(F("Update success, rebooting..."));
 		delay(500);
+		properties.flush();
 		ESP.restart();
 	}
 }
@@ -1064,8 +1262,10 @@ void MppServer::webHandleUploadedProps() {
 	else if (propsError.length() > 0)
 		webHandlePropsError();
 	else {
-		properties.update(propsUpdate);
-		webSendBackForm(F("Properties uploaded."));
+		if (properties.update(propsUpdate))
+			webSendBackForm(F("Properties uploaded."));
+		else
+			webSendBackForm(properties.getError(), 400);
 	}
 }
 
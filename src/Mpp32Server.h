@@ -35,17 +35,28 @@ For devices managed by AutomationManager (AM)
  GET http://ip:8898/version - returns the base and device version
  GET http://ip:8898/survey - returns a json array of the available wifi signals
  GET http://ip:8898/ - returns a body of JSON array of device state (for multi-devices)
+ GET http://ip:8898/?format=cbor - the same as a CBOR array of maps (application/cbor)
  PUT http://ip:8898/subscribe - body is the host address (IP).  Notifications are sent to this IP on port 8898 as UDP with a JSON body with the device state.
+ PUT http://ip:8898/subscribe?format=cbor - as above, notifications are sent as CBOR (RFC 8949) maps instead of JSON.
+ PUT http://ip:8898/subscribe?mode=multicast - as above, when the NotifyGroup property is set (ip[:port], or true for 239.255.255.250:8898)
+ notifications go out once to that multicast group for all such subscribers and the group is returned as the body.
  Subscriptions are valid for 10m and can be renewed any time.
  PUT http://ip:8898/name/udn - set the friendly name of the device with a JSON body:  { "name":"new_device_name" }
  GET http://ip:8898/state/udn - where resource is the device UDN of a device. Returns the current device state as a JSON body.
+ GET http://ip:8898/state/udn?since={seq} - returns only the attributes changed after seq as {"seq":n,"changes":{...}} (removed as null,
+ "full":true when a complete state is sent instead), 304 when nothing changed.  Use the returned seq in the next call.
 
  Discovery
  A UDP message to 239.255.255.250:8898 containing the string "discovery" will cause the device to respond to the sender with the device discovery information.
+ "discovery cbor" gets the response as a CBOR array instead of JSON.
 
  Management calls:
  GET http://ip:8898/defaults - returns a JSON body containing the current configuration settings
  PUT http://ip:8898/defaults - change configuration with a JSON body containing configuration updates.  Returns the new configuration as JSON.
+ PATCH http://ip:8898/defaults (or PUT with ?merge=true) - JSON merge patch of the configuration, absent keys are unchanged and null removes a key.
+ Returns only the changed keys as JSON (removed as null).
+ Values of registered properties (registerProperty) that do not fit their type or range are rejected with 400 and nothing is changed,
+ a Restart-Required: true header is returned when a changed property is only read at startup.
 
  *******************************************************************************
  **** JSON state and discovery response.  Implementation need only update state and value.
@@ -77,6 +88,7 @@ extern const char* P_BUTTON_PIN;
 // managed by the MppServer (no need to pass these in the MppServer constructor)
 
 extern const char* P_NO_MULTICAST;
+extern const char* P_NOTIFY_GROUP;
 // extern const char* P_USE_STATIC_IP;
 extern const char* P_IP;
 extern const char* P_GW;
@@ -87,6 +99,8 @@ extern const char* P_Ethernet_RESTART;
 
 extern const char* P_GATEWAY_PW;
 extern const char* P_NICKNAME;
+extern const char* P_SAVE_DELAY;
+extern const char* P_SAVE_MAX_DELAY;
 
 
 // Button reset length in ms
@@ -115,10 +129,20 @@ public:
 	bool isProperty(const char* property); // false if the value is not set or not true
 	bool hasProperty(const char* property); // false if the value is not set
 	void setPropertyDefault(const char* property, const char* value); // set a default if not already set
-	void putProperty(const char* property, const char* value); // set/override a property value
+	bool putProperty(const char* property, const char* value); // set/override a property value, false if invalid
 	void removeProperty(const char* property); // from the property set
 	bool usesProperty(const char* property); // property applicable to this device
 	void noteProperty(const char* property, const char* value); // visible but not persisted
+	// type, default, range and restart flag of a property, after which
+	// invalid values are rejected (e.g. at PUT /defaults) and typed reads
+	// return the default rather than 0 when it is not set
+	void registerProperty(const char* property, MppPropertyType type,
+			const char* defaultValue = NULL, float min = 0, float max = 0,
+			bool requiresRestart = false);
+	void registerProperties(const MppPropertySpec specs[], unsigned count);
+	// observer is called with the old and new value whenever the property
+	// changes, e.g. to cache a typed value instead of reading it each loop
+	void onPropertyChange(const char* property, MppPropertyObserver observer);
 
 	// Attach wifi handler to ButtonPin (if defined)
 	// 	 MppServer will report when the button is clicked (released).
@@ -161,13 +185,15 @@ protected:
 
 	MppDevice* getDevice(String udnString);
 	virtual String getDiscovery();
+	unsigned getCborDiscoveryLength();
+	size_t printCborDiscovery(Print& out); // getDiscovery() as a cbor array
 	void addDevice(MppDevice* device);
 	MppDevice** getDevices() { return devices; }
 	unsigned getDeviceCount() { return deviceCount; }
 	virtual bool mppHandleAction(HTTPMethod method, String action, String resource, MppParameters parms);
 	virtual bool processCommand(String input);
 
-	void sendDiscoveryResponse(IPAddress remoteIp, int remotePort);
+	void sendDiscoveryResponse(IPAddress remoteIp, int remotePort, bool binary = false);
 	virtual int handleIncomingUdp(NetworkUDP &serverUdp, int packetSize);
 
 	void mppHttpRespond(int code, const String& type = "", const String& response = "") { mppServer.send(code,type,response); }
@@ -230,6 +256,8 @@ bool onGotIP(); // Handler for GOT_IP event NetworkEvents networkEvents;
 	String updateError;
 	String propsError;
 	String propsUpdate;
+	String notifyGroup; // ip:port of the multicast subscribers
+	void startNotifyGroup();
 	const char* extraHelp;
 
 };
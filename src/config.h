@@ -16,5 +16,15 @@ For devices managed by AutomationManager (AM)
 #define ETH_PHY_MDIO  18
 #include <ETH.h> // important to set up after !*/
 
+// keep the properties in a journal on this data partition instead of NVS,
+// see Mpp32Journal.h
+// #define MPP_PROPERTIES_JOURNAL "mppjournal"
+// or packed into NVS pages, for large sets on boards without that partition
+// #define MPP_PROPERTIES_PAGED
+
+// device notifications are sent by a task (stack size) so put() doesn't wait
+// for them, comment out to send them from put() again
+#define MPP_NOTIFY_TASK 6144
+
 
 #endif // CONFIG_H
@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+
+/*
+ * Arduino.h for the host tests, only what the tested sources use
+ *
+ */
+
+#ifndef MPP_TEST_ARDUINO_H_
+#define MPP_TEST_ARDUINO_H_
+
+class String {
+public:
+	String() {}
+	String(const char* text) { if (text != NULL) s = text; }
+	unsigned length() const { return s.size(); }
+	const char* c_str() const { return s.c_str(); }
+	bool reserve(unsigned size) { s.reserve(size); return true; }
+	bool concat(const char* text, unsigned length) { s.append(text, length); return true; }
+	String& operator+=(const char* text) { if (text != NULL) s += text; return *this; }
+	String& operator+=(const String& other) { s += other.s; return *this; }
+	String& operator+=(char c) { s += c; return *this; }
+	bool operator==(const char* text) const { return s == (text == NULL ? "" : text); }
+private:
+	std::string s;
+};
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size) {
+		size_t n = 0;
+		while (size--)
+			n += write(*buffer++);
+		return n;
+	}
+	size_t println(const char* text = "") {
+		return write((const uint8_t*) text, strlen(text)) + write('\n');
+	}
+	size_t printf(const char* format, ...) {
+		char buffer[256];
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(buffer, sizeof(buffer), format, args);
+		va_end(args);
+		if (n > (int) sizeof(buffer) - 1)
+			n = sizeof(buffer) - 1;
+		return n < 0 ? 0 : write((const uint8_t*) buffer, n);
+	}
+};
+
+class Stream: public Print {
+public:
+	virtual int read() = 0;
+	size_t readBytes(char* buffer, size_t length) {
+		size_t n = 0;
+		int c;
+		while (n < length && (c = read()) >= 0)
+			buffer[n++] = c;
+		return n;
+	}
+};
+
+class HardwareSerial: public Stream {
+public:
+	size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+	int read() { return -1; }
+};
+
+inline HardwareSerial Serial;
+
+#endif /* MPP_TEST_ARDUINO_H_ */
@@ -0,0 +1,165 @@
+#include <Arduino.h>
+#include "Mpp32Journal.h"
+
+/*
+ * journal_test.cpp, MppJournalStore on an MppRamFlash image
+ *
+ * format, replay, a torn record and compaction across the ring wrap
+ *
+ */
+
+#define SECTORS 4
+#define SECTOR_SIZE 1024
+#define JOURNAL_HEADER 16
+
+static unsigned failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static void check(bool condition, const char *text, int line) {
+	if (!condition) {
+		printf("FAILED line %d: %s\n", line, text);
+		++failures;
+	}
+}
+
+// sector appended to last, its sequence is set to the highest one
+static unsigned newestSector(uint8_t *image, uint32_t *highest) {
+	unsigned newest = 0;
+	*highest = 0;
+	for (unsigned sector = 0; sector < SECTORS; sector++) {
+		uint32_t header[4];
+		memcpy(header, image + sector * SECTOR_SIZE, sizeof(header));
+		if (memcmp(header, "MPPJ", 4) == 0 && header[1] > *highest) {
+			*highest = header[1];
+			newest = sector;
+		}
+	}
+	return newest;
+}
+
+// offset of the last record in the sector, 0 if there is none
+static unsigned lastRecord(uint8_t *image, unsigned sector) {
+	uint8_t *start = image + sector * SECTOR_SIZE;
+	unsigned last = 0;
+	for (unsigned at = JOURNAL_HEADER; at + 4 <= SECTOR_SIZE;) {
+		if (start[at] == 0xFF && start[at + 1] == 0xFF && start[at + 2] == 0xFF
+				&& start[at + 3] == 0xFF)
+			break;
+		last = at;
+		at += (4 + (start[at] | start[at + 1] << 8) + 4 + 3) & ~3u;
+	}
+	return last;
+}
+
+// a power cut before the crc of the last record was written
+static void tear(uint8_t *image, unsigned sector) {
+	uint8_t *record = image + sector * SECTOR_SIZE + lastRecord(image, sector);
+	unsigned length = record[0] | record[1] << 8;
+	memset(record + 4 + length, 0xFF, 4);
+}
+
+static void testReplay(MppRamFlash &flash) {
+	{
+		MppJournalStore store(flash);
+		MppJson properties;
+		CHECK(!store.load(properties)); // erased, nothing saved yet
+		properties.put("a", "1");
+		properties.put("b", "x");
+		CHECK(store.save(properties, 0));
+		CHECK(memcmp(flash.getImage(), "MPPJ", 4) == 0);
+		uint32_t saved = properties.getSequence();
+		properties.put("a", "2");
+		properties.remove("b");
+		properties.put("c", NULL);
+		CHECK(store.save(properties, saved));
+	}
+	MppJournalStore store(flash);
+	MppJson properties;
+	CHECK(store.load(properties));
+	CHECK(strcmp(properties.get("a"), "2") == 0);
+	CHECK(!properties.contains("b"));
+	CHECK(properties.contains("c") && !properties.has("c"));
+}
+
+static void testTorn(MppRamFlash &flash) {
+	{
+		MppJournalStore store(flash);
+		MppJson properties;
+		CHECK(store.load(properties));
+		uint32_t saved = properties.getSequence();
+		properties.put("d", "4");
+		CHECK(store.save(properties, saved));
+	}
+	tear(flash.getImage(), 0);
+	{
+		MppJournalStore store(flash);
+		MppJson properties;
+		CHECK(store.load(properties));
+		CHECK(!properties.contains("d"));
+		CHECK(strcmp(properties.get("a"), "2") == 0);
+		// the torn record closes its sector, the next save goes on
+		uint32_t saved = properties.getSequence();
+		properties.put("e", "5");
+		CHECK(store.save(properties, saved));
+	}
+	MppJournalStore store(flash);
+	MppJson properties;
+	CHECK(store.load(properties));
+	CHECK(strcmp(properties.get("e"), "5") == 0);
+	CHECK(!properties.contains("d"));
+}
+
+static void testWrap(MppRamFlash &flash) {
+	char key[8], value[16];
+	{
+		MppJournalStore store(flash);
+		MppJson properties;
+		CHECK(store.load(properties));
+		for (int i = 0; i < 500; i++) {
+			uint32_t saved = properties.getSequence();
+			snprintf(value, sizeof(value), "%d", i);
+			snprintf(key, sizeof(key), "x%d", i % 7);
+			properties.put("k", value);
+			properties.put(key, value);
+			CHECK(store.save(properties, saved));
+			store.handle(properties);
+		}
+		CHECK(store.getFreeSectors() > 0);
+	}
+	// the sectors were reused several times
+	uint32_t highest;
+	newestSector(flash.getImage(), &highest);
+	CHECK(highest > 2 * SECTORS);
+	{
+		MppJournalStore store(flash);
+		MppJson properties;
+		CHECK(store.load(properties));
+		CHECK(strcmp(properties.get("k"), "499") == 0);
+		for (int i = 0; i < 7; i++) {
+			snprintf(key, sizeof(key), "x%d", i);
+			snprintf(value, sizeof(value), "%d", 499 - (499 - i) % 7);
+			CHECK(strcmp(properties.get(key), value) == 0);
+		}
+		CHECK(strcmp(properties.get("a"), "2") == 0);
+		CHECK(strcmp(properties.get("e"), "5") == 0);
+		uint32_t saved = properties.getSequence();
+		properties.put("k", "last");
+		CHECK(store.save(properties, saved));
+	}
+	// torn in the last sector of the wrapped ring
+	tear(flash.getImage(), newestSector(flash.getImage(), &highest));
+	MppJournalStore store(flash);
+	MppJson properties;
+	CHECK(store.load(properties));
+	CHECK(strcmp(properties.get("k"), "499") == 0);
+}
+
+int main() {
+	MppRamFlash flash(SECTORS * SECTOR_SIZE, SECTOR_SIZE);
+	testReplay(flash);
+	testTorn(flash);
+	testWrap(flash);
+	printf("journal: %s\n", failures == 0 ? "passed" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}